@@ -0,0 +1,230 @@
+/* Differential benchmarks: run some representative workloads under tosh and under whichever
+ * reference shells are around (dash, bash, sh), and report wall time, CPU time, context switches,
+ * page faults and peak RSS for each (from the rusage of the shell and everything it waited for).
+ *
+ * Usage (from the top of the repo, after building tosh): bench/bench [TOSH [REPEATS]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_PATH 4096
+
+// A workload: a script (the same text for every shell), generated by writing
+// `lines` lines, each made by a function of the line number.
+struct bench_workload {
+	char *name;
+	char *desc;
+	int lines;
+	void (*line)(FILE *, int);
+};
+
+// Directory the workloads (and the files they glob) live in.
+char BENCH_DIR[BENCH_MAX_PATH];
+
+// Number of files to glob over.
+#define BENCH_NUM_FILES 2000
+
+// Full path to an external `true` (so that no shell can run it as a builtin).
+char BENCH_TRUE[BENCH_MAX_PATH];
+
+void bench_spawn_line(FILE *fp, int n) {
+	fprintf(fp, "%s\n", BENCH_TRUE);
+}
+
+void bench_builtin_line(FILE *fp, int n) {
+	fprintf(fp, "cd %s\n", BENCH_DIR);
+}
+
+void bench_glob_line(FILE *fp, int n) {
+	fprintf(fp, "echo %s/files/*%d?\n", BENCH_DIR, n % 10);
+}
+
+void bench_subst_line(FILE *fp, int n) {
+	fprintf(fp, "echo $(echo %d) $(echo $(echo nested))\n", n);
+}
+
+void bench_args_line(FILE *fp, int n) {
+	int i;
+
+	fprintf(fp, "echo");
+	for (i = 0; i < 5000; i++)
+		fprintf(fp, " arg%d", i);
+	fprintf(fp, "\n");
+}
+
+void bench_bigglob_line(FILE *fp, int n) {
+	fprintf(fp, "ls %s/files/*\n", BENCH_DIR);
+}
+
+struct bench_workload bench_workloads[] = {
+	{ "spawn", "1000 external commands", 1000, bench_spawn_line },
+	{ "builtin", "5000 builtin commands", 5000, bench_builtin_line },
+	{ "glob", "500 globs over a directory of 2000 files", 500, bench_glob_line },
+	{ "subst", "200 lines of (nested) command substitution", 200, bench_subst_line },
+	{ "args", "50 commands with 5000 arguments each", 50, bench_args_line },
+	{ "bigglob", "50 commands globbing 2000 files each", 50, bench_bigglob_line },
+};
+
+// Reference shells to compare against (if they can be found).
+char *bench_shells[] = { "dash", "bash", "sh" };
+
+/* Find an executable on PATH, putting its full path in buf. Returns 1 if found. */
+int bench_find(char *name, char *buf) {
+	char *path = getenv("PATH"), *dir, *copy;
+
+	if (path == NULL || (copy = strdup(path)) == NULL)
+		return 0;
+	for (dir = strtok(copy, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+		snprintf(buf, BENCH_MAX_PATH, "%s/%s", dir, name);
+		if (access(buf, X_OK) == 0) {
+			free(copy);
+			return 1;
+		}
+	}
+	free(copy);
+	return 0;
+}
+
+/* Write out a workload's script. Returns 0 on failure. */
+int bench_write_script(struct bench_workload *w, char *path) {
+	FILE *fp;
+	int i;
+
+	snprintf(path, BENCH_MAX_PATH, "%s/%s.sh", BENCH_DIR, w->name);
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		return 0;
+	}
+	for (i = 0; i < w->lines; i++)
+		w->line(fp, i);
+	fclose(fp);
+	return 1;
+}
+
+/* Make the directory of files for the glob workloads. Returns 0 on failure. */
+int bench_make_files(void) {
+	char path[BENCH_MAX_PATH];
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/files", BENCH_DIR);
+	if (mkdir(path, 0755) == -1) {
+		perror(path);
+		return 0;
+	}
+	for (i = 0; i < BENCH_NUM_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/files/file%05d", BENCH_DIR, i);
+		if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) == -1) {
+			perror(path);
+			return 0;
+		}
+		close(fd);
+	}
+	return 1;
+}
+
+/* Run a shell on a script (with output thrown away), and add up what it cost. Returns 0 on failure. */
+int bench_run(char *shell, char *script, double *wall, struct rusage *ru) {
+	struct timespec start, end;
+	int status, devnull;
+	pid_t id;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((id = fork()) == 0) {
+		devnull = open("/dev/null", O_RDWR);
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		// (Keep tosh out of the real history file.)
+		setenv("TOSH_HIST_PATH", "/dev/null", 1);
+		execl(shell, shell, script, (char *) NULL);
+		exit(127);
+	} else if (id < 0) {
+		perror("bench");
+		return 0;
+	}
+	// (The rusage from wait4() covers the shell and every child it waited for.)
+	if (wait4(id, &status, 0, ru) == -1) {
+		perror("bench");
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) != 127;
+}
+
+double bench_secs(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Run a workload a number of times under a shell, and print the best (i.e. least noisy) run. */
+void bench_report(char *label, char *shell, char *script, int repeats) {
+	struct rusage ru, best_ru;
+	double wall, best = -1;
+	int i;
+
+	for (i = 0; i < repeats; i++) {
+		if (!bench_run(shell, script, &wall, &ru)) {
+			printf("  %-8s %s\n", label, "(failed)");
+			return;
+		}
+		if (best < 0 || wall < best) {
+			best = wall;
+			best_ru = ru;
+		}
+	}
+	printf("  %-8s %9.3f %9.3f %9.3f %10ld %10ld %10ld\n", label, best,
+			bench_secs(best_ru.ru_utime), bench_secs(best_ru.ru_stime),
+			best_ru.ru_nvcsw + best_ru.ru_nivcsw, best_ru.ru_minflt, best_ru.ru_maxrss);
+}
+
+int main(int argc, char **argv) {
+	char tosh[BENCH_MAX_PATH], shell[BENCH_MAX_PATH], script[BENCH_MAX_PATH], cmd[BENCH_MAX_PATH];
+	int i, j, repeats = 3;
+	int num_workloads = sizeof(bench_workloads) / sizeof(struct bench_workload);
+	int num_shells = sizeof(bench_shells) / sizeof(char *);
+
+	if (realpath((argc > 1) ? argv[1] : "./tosh", tosh) == NULL || access(tosh, X_OK) != 0) {
+		fprintf(stderr, "bench: I couldn't find tosh (build it first, or pass its path). :(\n");
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		repeats = atoi(argv[2]);
+	if (!bench_find("true", BENCH_TRUE)) {
+		fprintf(stderr, "bench: I couldn't find true. :(\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(BENCH_DIR, sizeof(BENCH_DIR), "%s/tosh-bench.XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(BENCH_DIR) == NULL) {
+		perror("bench");
+		return EXIT_FAILURE;
+	}
+	if (!bench_make_files())
+		return EXIT_FAILURE;
+
+	printf("best of %d runs; times in seconds, RSS in KB (as reported by getrusage)\n", repeats);
+	for (i = 0; i < num_workloads; i++) {
+		if (!bench_write_script(&bench_workloads[i], script))
+			return EXIT_FAILURE;
+		printf("\n%s: %s\n", bench_workloads[i].name, bench_workloads[i].desc);
+		printf("  %-8s %9s %9s %9s %10s %10s %10s\n", "shell", "wall", "user", "sys", "ctxsw", "minflt", "maxrss");
+		bench_report("tosh", tosh, script, repeats);
+		for (j = 0; j < num_shells; j++)
+			if (bench_find(bench_shells[j], shell))
+				bench_report(bench_shells[j], shell, script, repeats);
+	}
+
+	// Clean up.
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", BENCH_DIR);
+	system(cmd);
+
+	return EXIT_SUCCESS;
+}
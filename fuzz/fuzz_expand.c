@@ -0,0 +1,213 @@
+/* Fuzz harness for tosh's lexer and expander.
+ * Feeds arbitrary lines through tosh_split_line() and tosh_expand_args() (with subshells stubbed out,
+ * so that expressions expand to their own text).
+ *
+ * Built with -DTOSH_LIBFUZZER, this is a libFuzzer target. Otherwise, it's a plain program:
+ *   fuzz_expand FILE...       run each file through once (e.g. for AFL, with `fuzz_expand @@`)
+ *   fuzz_expand -s FILE...    stress: make every allocation fail in turn, and check we never crash
+ *   fuzz_expand -b FILE...    benchmark: report throughput over the files (e.g. the corpus) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "../src/tosh.h"
+
+#undef malloc
+#undef realloc
+
+// From tosh.c
+char **tosh_expand_args(struct tosh_word *);
+
+// The allocation (counting from 1) which should fail; 0 means none of them.
+long TOSH_FUZZ_FAIL_AT;
+long TOSH_FUZZ_NUM_ALLOCS;
+
+void *tosh_fuzz_malloc(size_t size) {
+	if (++TOSH_FUZZ_NUM_ALLOCS == TOSH_FUZZ_FAIL_AT)
+		return NULL;
+	return malloc(size);
+}
+
+void *tosh_fuzz_realloc(void *ptr, size_t size) {
+	if (++TOSH_FUZZ_NUM_ALLOCS == TOSH_FUZZ_FAIL_AT)
+		return NULL;
+	return realloc(ptr, size);
+}
+
+/* Stand-in for evaluating an expression in a subshell: just give back the expression. */
+struct tosh_view tosh_eval_line(char *line) {
+	struct tosh_view result = tosh_view(line);
+
+	if ((result.str = tosh_fuzz_malloc((result.len + 1) * sizeof(char))) == NULL) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(result.str, line, result.len + 1);
+	return result;
+}
+
+/* Split and expand a line, then throw the result away. */
+void tosh_fuzz_line(char *line) {
+	struct tosh_word *words;
+	char **args;
+
+	if ((words = tosh_split_line(line)) == NULL)
+		return;
+	args = tosh_expand_args(words);
+	free(words);
+	free(args);
+}
+
+/* Run some (not necessarily null-terminated) input through, one line at a time. */
+void tosh_fuzz_input(const char *data, size_t size) {
+	char *buf = malloc(size + 1), *line, *next;
+
+	if (!buf)
+		return;
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+	for (line = buf; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		tosh_fuzz_line(line);
+	}
+	free(buf);
+}
+
+#ifdef TOSH_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	tosh_fuzz_input((const char *) data, size);
+	return 0;
+}
+
+#else
+
+/* Read a whole file into memory. Returns a dynamically allocated buffer, or a null pointer. */
+char *tosh_fuzz_read_file(char *path, size_t *size) {
+	FILE *fp;
+	char *buf;
+	long len;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	if ((buf = malloc(len + 1)) == NULL || fread(buf, 1, len, fp) != (size_t) len) {
+		fprintf(stderr, "fuzz_expand: I couldn't read %s. :(\n", path);
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*size = len;
+	return buf;
+}
+
+/* Make each allocation in turn fail while running the input, checking that tosh either copes or
+ * exits cleanly (rather than crashing). Returns the number of crashes. */
+int tosh_fuzz_stress(char *path, char *data, size_t size) {
+	long n, total;
+	int status, crashes = 0;
+	pid_t id;
+
+	// Count the allocations made on a normal run.
+	TOSH_FUZZ_NUM_ALLOCS = 0;
+	TOSH_FUZZ_FAIL_AT = 0;
+	tosh_fuzz_input(data, size);
+	total = TOSH_FUZZ_NUM_ALLOCS;
+
+	for (n = 1; n <= total; n++) {
+		fflush(NULL);
+		if ((id = fork()) == 0) {
+			// (tosh complains about failed allocations; we know.)
+			freopen("/dev/null", "w", stderr);
+			TOSH_FUZZ_NUM_ALLOCS = 0;
+			TOSH_FUZZ_FAIL_AT = n;
+			tosh_fuzz_input(data, size);
+			exit(EXIT_SUCCESS);
+		} else if (id < 0) {
+			perror("fuzz_expand");
+			return crashes;
+		}
+		waitpid(id, &status, 0);
+		if (WIFSIGNALED(status)) {
+			printf("%s: crashed (signal %d) when allocation %ld of %ld failed\n",
+					path, WTERMSIG(status), n, total);
+			crashes++;
+		}
+	}
+	printf("%s: %ld allocations, %d crashes\n", path, total, crashes);
+	return crashes;
+}
+
+// Number of passes over the inputs when benchmarking.
+#define TOSH_FUZZ_BENCH_PASSES 2000
+
+int main(int argc, char **argv) {
+	int i, mode = 0, crashes = 0, pass;
+	char **data;
+	size_t *sizes, total = 0;
+	struct timespec start, end;
+	double secs;
+
+	if (argc > 1 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-b") == 0)) {
+		mode = argv[1][1];
+		argv++;
+		argc--;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "usage: fuzz_expand [-s | -b] FILE...\n");
+		return EXIT_FAILURE;
+	}
+
+	data = malloc(argc * sizeof(char *));
+	sizes = malloc(argc * sizeof(size_t));
+	if (!data || !sizes) {
+		fprintf(stderr, "fuzz_expand: memory allocation failed. :(\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 1; i < argc; i++) {
+		if ((data[i] = tosh_fuzz_read_file(argv[i], &sizes[i])) == NULL)
+			return EXIT_FAILURE;
+		total += sizes[i];
+	}
+
+	switch (mode) {
+		case 's':
+			for (i = 1; i < argc; i++)
+				crashes += tosh_fuzz_stress(argv[i], data[i], sizes[i]);
+			break;
+		case 'b':
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (pass = 0; pass < TOSH_FUZZ_BENCH_PASSES; pass++)
+				for (i = 1; i < argc; i++)
+					tosh_fuzz_input(data[i], sizes[i]);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("%d passes over %d files (%zu bytes) in %.3fs: %.2f MB/s\n",
+					TOSH_FUZZ_BENCH_PASSES, argc - 1, total, secs,
+					total * (double) TOSH_FUZZ_BENCH_PASSES / secs / 1e6);
+			break;
+		default:
+			for (i = 1; i < argc; i++)
+				tosh_fuzz_input(data[i], sizes[i]);
+			break;
+	}
+
+	for (i = 1; i < argc; i++)
+		free(data[i]);
+	free(data);
+	free(sizes);
+	return (crashes) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,152 @@
+/* Batching of long argument lists.
+ * A glob over a big directory can easily make more arguments than the kernel will pass to
+ * a program in one go (execvp() fails with E2BIG). The `batch` builtin splits them up into
+ * as many invocations as it takes (like xargs), run one after another or several at a time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h> /* _POSIX_ARG_MAX */
+#include <sys/wait.h>
+#include <sys/resource.h> /* wait4() */
+#include <spawn.h>
+#include "tosh.h"
+
+extern char **environ;
+
+// Space to leave spare below ARG_MAX (as POSIX suggests for xargs).
+#define BATCH_HEADROOM 2048
+
+/* The number of bytes of arguments and environment we can pass to a program. */
+long tosh_arg_max(void) {
+	static long arg_max = 0;
+
+	if (arg_max == 0) {
+		if ((arg_max = sysconf(_SC_ARG_MAX)) <= 0)
+			arg_max = _POSIX_ARG_MAX;
+		arg_max -= BATCH_HEADROOM;
+	}
+	return arg_max;
+}
+
+/* The number of bytes (as exec counts them) taken up by a null-terminated list of strings. */
+long tosh_args_size(char **args) {
+	long size = sizeof(char *);
+
+	for (; *args != NULL; args++)
+		size += strlen(*args) + 1 + sizeof(char *);
+	return size;
+}
+
+/* Check whether a program can be run with these arguments (and our environment) in one go. */
+int tosh_args_fit(char **args) {
+	return tosh_args_size(args) + tosh_args_size(environ) <= tosh_arg_max();
+}
+
+/* Wait for one of the running invocations (pids, of which there are *running) to finish,
+ * and take it off the list. Returns 1 if it failed, and 0 if it succeeded.
+ * Only these are waited for (any other child, e.g. a coprocess, is left for whoever started it):
+ * one that has already finished if there is one, or else the first on the list. */
+int tosh_batch_wait(pid_t *pids, int *running) {
+	struct rusage usage;
+	pid_t wpid = 0;
+	int status, i;
+
+	for (i = 0; i < *running && wpid == 0; i++) {
+		TOSH_COUNT(TOSH_SYS_WAIT);
+		wpid = wait4(pids[i], &status, WNOHANG, &usage);
+	}
+	if (wpid == 0) {
+		i = 1;
+		do {
+			TOSH_COUNT(TOSH_SYS_WAIT);
+			wpid = wait4(pids[0], &status, 0, &usage);
+		} while (wpid == -1 && errno == EINTR);
+	}
+
+	// (i is one past the one we waited for.)
+	pids[i - 1] = pids[--*running];
+	if (wpid == -1)
+		return 1;
+	tosh_report_child(&usage, &status);
+	if (strcmp(TOSH_VERBOSE, "ON") == 0)
+		printf("[%d terminated with exit code %d]\n", wpid, status / 256);
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/* Work out which of args (from i on) go in the next invocation: as many as fit in max bytes, but
+ * no more than max_args of them (unless that's 0), and always at least one. Returns the index after
+ * the last of them, and sets *size to the number of bytes (as exec counts them) they take up. */
+int tosh_batch_next(char **args, int i, long max, int max_args, long *size) {
+	long len;
+	int n;
+
+	for (*size = 0, n = 0; args[i] != NULL && (max_args == 0 || n < max_args); i++, n++) {
+		len = strlen(args[i]) + 1 + sizeof(char *);
+		if (*size + len > max && n > 0)
+			break;
+		*size += len;
+	}
+	return i;
+}
+
+/* Run args[0] with its first num_fixed arguments (e.g. options) and as many of the rest as
+ * will fit at once (or up to max_args of them, unless that's 0), over and over until the rest
+ * are used up, with up to jobs of them running at a time. Returns the number of invocations
+ * that failed. */
+int tosh_batch_launch(char **args, int num_fixed, int max_args, int jobs) {
+	char **argv;
+	pid_t id, *pids;
+	int num_args, i, n, end, err, running = 0, failed = 0;
+	long size, max;
+
+	for (num_args = 0; args[num_args] != NULL; num_args++)
+		;
+	argv = malloc((num_args + 1) * sizeof(char *));
+	pids = malloc(jobs * sizeof(pid_t));
+	if (!argv || !pids) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// The fixed part is the same every time; the rest get whatever room is left.
+	memcpy(argv, args, num_fixed * sizeof(char *));
+	argv[num_fixed] = NULL;
+	max = tosh_arg_max() - tosh_args_size(environ) - tosh_args_size(argv);
+
+	for (i = num_fixed; i < num_args; i = end) {
+		// Take as many arguments as fit.
+		end = tosh_batch_next(args, i, max, max_args, &size);
+		memcpy(&argv[num_fixed], &args[i], (end - i) * sizeof(char *));
+		n = num_fixed + end - i;
+		argv[n] = NULL;
+		DEBUG_LOG("batch: running %s with %d arguments.", argv[0], n - 1)
+
+		// Wait for a free slot.
+		if (running == jobs)
+			failed += tosh_batch_wait(pids, &running);
+
+		tosh_flush();
+		TOSH_COUNT(TOSH_SYS_FORK);
+		TOSH_COUNT(TOSH_SYS_EXEC);
+		if ((err = posix_spawnp(&id, argv[0], NULL, NULL, argv, environ)) != 0) {
+			tosh_error("tosh: %s\n", strerror(err));
+			failed++;
+			break;
+		}
+		if (strcmp(TOSH_VERBOSE, "ON") == 0) {
+			printf("[launching %s (%d arguments) with pid %d]\n", argv[0], n - 1, id);
+			tosh_flush();
+		}
+		pids[running++] = id;
+	}
+
+	while (running > 0)
+		failed += tosh_batch_wait(pids, &running);
+
+	free(argv);
+	free(pids);
+	return failed;
+}
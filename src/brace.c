@@ -0,0 +1,265 @@
+/* Brace expansion.
+ * `pre{a,b}post` becomes `preapost prebpost`, and `f{1..3}` becomes `f1 f2 f3` (also `{a..e}`,
+ * `{1..10..2}`, `{01..10}`, and any nesting of these). The words are generated one at a time,
+ * straight into wherever they're going (rather than building up lists of partial words), so
+ * that `touch f{1..100000}` costs no more than writing the arguments out.
+ * A character after a backslash (e.g. a brace or comma that was quoted) is never taken as part of
+ * a brace expression; the backslashes are left in the words, for whoever takes them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "tosh.h"
+
+// What's left of the pattern to expand: a list of pieces, to be expanded one after another.
+// (The pieces are slices of the original pattern, or of a number we've just written out.)
+struct tosh_brace_pat {
+	struct tosh_view v;
+	struct tosh_brace_pat *next;
+};
+
+// The state of an expansion: the word generated so far, and where to put finished ones.
+struct tosh_brace {
+	char *buf;
+	int len, size;
+	long total, limit;
+	int failed;
+	void (*emit)(struct tosh_view, void *);
+	void *data;
+};
+
+#define BRACE_BUF_INC 256
+
+/* Add some text to the end of the word being generated. */
+void tosh_brace_put(struct tosh_brace *b, struct tosh_view v) {
+	if (b->len + v.len + 1 > b->size) {
+		b->size = b->len + v.len + 1 + BRACE_BUF_INC;
+		b->buf = realloc(b->buf, b->size * sizeof(char));
+		if (!b->buf) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(&b->buf[b->len], v.str, v.len);
+	b->len += v.len;
+}
+
+/* Find the closing brace matching the opening one at o. Returns its index, or -1. */
+int tosh_brace_close(struct tosh_view v, int o) {
+	int i, depth = 0;
+
+	for (i = o; i < v.len; i++) {
+		if (v.str[i] == '\\') {
+			i++;
+		} else if (v.str[i] == '{') {
+			depth++;
+		} else if (v.str[i] == '}' && --depth == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Check whether the text between braces has a comma (outside of any inner braces). */
+int tosh_brace_is_list(struct tosh_view v) {
+	int i, depth = 0;
+
+	for (i = 0; i < v.len; i++) {
+		if (v.str[i] == '\\')
+			i++;
+		else if (v.str[i] == '{')
+			depth++;
+		else if (v.str[i] == '}')
+			depth--;
+		else if (v.str[i] == ',' && depth == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Parse a (possibly negative) integer taking up the whole of v. Returns 1 on success. */
+int tosh_brace_int(struct tosh_view v, long *n) {
+	char tmp[24], *end;
+
+	if (v.len == 0 || v.len >= (int) sizeof(tmp))
+		return 0;
+	memcpy(tmp, v.str, v.len);
+	tmp[v.len] = '\0';
+	if (!isdigit((unsigned char) tmp[tmp[0] == '-']))
+		return 0;
+	*n = strtol(tmp, &end, 10);
+	return *end == '\0';
+}
+
+/* Check whether the text between braces is a range (`X..Y` or `X..Y..STEP`, where X and Y are
+ * both integers or both single letters), and if so, get its endpoints, step and padding width. */
+int tosh_brace_is_range(struct tosh_view v, long *from, long *to, long *step, int *width, int *alpha) {
+	struct tosh_view parts[3];
+	int i, n = 0, start = 0;
+
+	for (i = 0; i + 1 < v.len && n < 2; i++) {
+		if (v.str[i] == '.' && v.str[i + 1] == '.') {
+			parts[n++] = tosh_view_slice(v, start, i);
+			start = i + 2;
+			i++;
+		}
+	}
+	if (n == 0)
+		return 0;
+	parts[n] = tosh_view_slice(v, start, v.len);
+
+	*step = 1;
+	if (n == 2 && !tosh_brace_int(parts[2], step))
+		return 0;
+	if (*step == 0)
+		*step = 1;
+	if (*step < 0)
+		*step = -*step;
+
+	if (parts[0].len == 1 && parts[1].len == 1 && isalpha((unsigned char) parts[0].str[0])
+			&& isalpha((unsigned char) parts[1].str[0])) {
+		*alpha = 1;
+		*from = parts[0].str[0];
+		*to = parts[1].str[0];
+		*width = 0;
+		return 1;
+	}
+	*alpha = 0;
+	if (!tosh_brace_int(parts[0], from) || !tosh_brace_int(parts[1], to))
+		return 0;
+
+	// Zero-padded if either end is written with a leading zero (e.g. `{01..10}`).
+	*width = 0;
+	for (i = 0; i < 2; i++) {
+		if ((parts[i].str[0] == '0' && parts[i].len > 1) || (parts[i].len > 2 && parts[i].str[1] == '0' && parts[i].str[0] == '-'))
+			*width = (parts[0].len > parts[1].len) ? parts[0].len : parts[1].len;
+	}
+	return 1;
+}
+
+void tosh_brace_gen(struct tosh_brace *, struct tosh_brace_pat *);
+
+/* Generate words from each alternative of the list between braces (in v), then the rest. */
+void tosh_brace_gen_list(struct tosh_brace *b, struct tosh_view v, struct tosh_brace_pat *rest) {
+	struct tosh_brace_pat alt;
+	int i, depth = 0, start = 0;
+
+	alt.next = rest;
+	for (i = 0; i <= v.len && !b->failed; i++) {
+		if (i + 1 < v.len && v.str[i] == '\\') {
+			i++;
+		} else if (i < v.len && v.str[i] == '{') {
+			depth++;
+		} else if (i < v.len && v.str[i] == '}') {
+			depth--;
+		} else if (i == v.len || (v.str[i] == ',' && depth == 0)) {
+			alt.v = tosh_view_slice(v, start, i);
+			tosh_brace_gen(b, &alt);
+			start = i + 1;
+		}
+	}
+}
+
+/* Generate words from each value of a range, then the rest. */
+void tosh_brace_gen_range(struct tosh_brace *b, long from, long to, long step, int width, int alpha,
+		struct tosh_brace_pat *rest) {
+	struct tosh_brace_pat value;
+	char tmp[32];
+	long n;
+
+	value.next = rest;
+	value.v.str = tmp;
+	for (n = from; (from <= to) ? n <= to : n >= to; n += (from <= to) ? step : -step) {
+		if (alpha) {
+			tmp[0] = n;
+			value.v.len = 1;
+		} else {
+			value.v.len = snprintf(tmp, sizeof(tmp), "%0*ld", width, n);
+		}
+		tosh_brace_gen(b, &value);
+		if (b->failed)
+			return;
+	}
+}
+
+/* Generate every word from the (rest of the) pattern, following on from what's been generated so far. */
+void tosh_brace_gen(struct tosh_brace *b, struct tosh_brace_pat *pat) {
+	struct tosh_brace_pat rest;
+	struct tosh_view v, inner;
+	long from, to, step;
+	int o, c, len = b->len, width, alpha;
+
+	// Skip past anything empty; if there's nothing left, we've made a word.
+	while (pat != NULL && pat->v.len == 0)
+		pat = pat->next;
+	if (pat == NULL) {
+		b->total += b->len + 1 + sizeof(char *);
+		if (b->limit > 0 && b->total > b->limit) {
+			b->failed = 1;
+			return;
+		}
+		b->buf[b->len] = '\0';
+		v.str = b->buf;
+		v.len = b->len;
+		b->emit(v, b->data);
+		return;
+	}
+	v = pat->v;
+
+	// Find the first pair of braces with something to expand in it.
+	for (o = 0; o < v.len; o++) {
+		if (v.str[o] == '\\')
+			o++;
+		if (o >= v.len || v.str[o] != '{' || (c = tosh_brace_close(v, o)) == -1)
+			continue;
+		inner = tosh_view_slice(v, o + 1, c);
+		rest.v = tosh_view_slice(v, c + 1, v.len);
+		rest.next = pat->next;
+
+		if (tosh_brace_is_list(inner)) {
+			tosh_brace_put(b, tosh_view_slice(v, 0, o));
+			tosh_brace_gen_list(b, inner, &rest);
+			b->len = len;
+			return;
+		}
+		if (tosh_brace_is_range(inner, &from, &to, &step, &width, &alpha)) {
+			tosh_brace_put(b, tosh_view_slice(v, 0, o));
+			tosh_brace_gen_range(b, from, to, step, width, alpha, &rest);
+			b->len = len;
+			return;
+		}
+	}
+
+	// Nothing to expand here; take it as it is.
+	tosh_brace_put(b, v);
+	tosh_brace_gen(b, pat->next);
+	b->len = len;
+}
+
+/* Expand the braces in a pattern, handing each word generated to emit() (along with data),
+ * as a null-terminated string which is only good until emit() returns.
+ * Gives up (returning 0) once the words would take up more than limit bytes as arguments
+ * (as tosh_args_size() counts them), or 0 for no limit. Returns 1 if it got through them all. */
+int tosh_brace_expand(struct tosh_view pattern, long limit, void (*emit)(struct tosh_view, void *), void *data) {
+	struct tosh_brace b;
+	struct tosh_brace_pat pat = { pattern, NULL };
+
+	b.size = pattern.len + 1 + BRACE_BUF_INC;
+	b.buf = malloc(b.size * sizeof(char));
+	if (!b.buf) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	b.len = 0;
+	b.total = 0;
+	b.limit = limit;
+	b.failed = 0;
+	b.emit = emit;
+	b.data = data;
+
+	tosh_brace_gen(&b, &pat);
+
+	free(b.buf);
+	return !b.failed;
+}
@@ -0,0 +1,330 @@
+/* Coprocesses.
+ * Some programs (interpreters, mostly) take far longer to start up than to do whatever they're
+ * asked. `coproc start NAME PROGRAM [ARGS...]` starts one once, with its stdin and stdout
+ * connected to the shell by a pair of pipes, and keeps it running; later lines then hand it
+ * requests and read back its answers (a line at a time) without starting anything at all.
+ * The pipes are close-on-exec, so the helper sees the end of its input only when we close it,
+ * and not when some other program we ran happens to exit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include "tosh.h"
+
+extern char **environ;
+
+// Increment for the buffers of requests, and of answers read but not yet handed out.
+#define COPROC_BUF_INC 4096
+
+// A running helper: the shell that started it (any other process with it in its table is a
+// subshell of that one, sharing its pipes), the ends of its pipes (in_fd is its stdin; out_fd
+// its stdout), and whatever it has written that nobody has asked for yet.
+struct tosh_coproc {
+	char *name, *prog;
+	pid_t pid, owner;
+	int in_fd, out_fd;
+	char *buf;
+	int len, size;
+};
+
+struct tosh_coproc TOSH_COPROCS[TOSH_MAX_COPROCS];
+int TOSH_NUM_COPROCS;
+
+/* Find a running helper by name. Returns a null pointer if there isn't one. */
+struct tosh_coproc *tosh_coproc_find(char *name) {
+	int i;
+
+	for (i = 0; i < TOSH_NUM_COPROCS; i++)
+		if (strcmp(TOSH_COPROCS[i].name, name) == 0)
+			return &TOSH_COPROCS[i];
+	return NULL;
+}
+
+/* Make a copy of a string. */
+char *tosh_coproc_dup(char *str) {
+	char *copy = malloc((strlen(str) + 1) * sizeof(char));
+
+	if (!copy) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	return strcpy(copy, str);
+}
+
+/* Start args[0] (with the rest of args) as a helper called name. Returns 0 on success, and -1
+ * (having said why) on failure. */
+int tosh_coproc_start(char *name, char **args) {
+	struct tosh_coproc *c;
+	posix_spawn_file_actions_t actions;
+	int to_fds[2], from_fds[2], err;
+	pid_t id;
+
+	if (tosh_coproc_find(name) != NULL) {
+		tosh_error("tosh: there's already a coprocess called %s. :(\n", name);
+		return -1;
+	}
+	if (TOSH_NUM_COPROCS == TOSH_MAX_COPROCS) {
+		tosh_error("tosh: too many coprocesses (stop one first). :(\n");
+		return -1;
+	}
+	if (!tosh_args_fit(args)) {
+		tosh_error("tosh: too many arguments for %s. :(\n", args[0]);
+		return -1;
+	}
+
+	if (tosh_fd_pipe(to_fds) == -1) {
+		tosh_perror();
+		return -1;
+	}
+	if (tosh_fd_pipe(from_fds) == -1) {
+		tosh_perror();
+		tosh_fd_close(to_fds[0]);
+		tosh_fd_close(to_fds[1]);
+		return -1;
+	}
+
+	// Its ends of the pipes become its stdin and stdout (and, being copies, aren't close-on-exec).
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, to_fds[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, from_fds[1], STDOUT_FILENO);
+
+	tosh_flush();
+	TOSH_COUNT(TOSH_SYS_FORK);
+	TOSH_COUNT(TOSH_SYS_EXEC);
+	err = posix_spawnp(&id, args[0], &actions, NULL, args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	tosh_fd_close(to_fds[0]);
+	tosh_fd_close(from_fds[1]);
+	if (err != 0) {
+		tosh_error("tosh: %s\n", strerror(err));
+		tosh_fd_close(to_fds[1]);
+		tosh_fd_close(from_fds[0]);
+		return -1;
+	}
+
+	c = &TOSH_COPROCS[TOSH_NUM_COPROCS++];
+	c->name = tosh_coproc_dup(name);
+	c->prog = tosh_coproc_dup(args[0]);
+	c->pid = id;
+	c->owner = getpid();
+	c->in_fd = to_fds[1];
+	c->out_fd = from_fds[0];
+	c->buf = NULL;
+	c->len = c->size = 0;
+	if (strcmp(TOSH_VERBOSE, "ON") == 0)
+		printf("[launching coprocess %s (%s) with pid %d]\n", name, args[0], id);
+	return 0;
+}
+
+/* Send a request to a helper: the words of args, separated by spaces, on a line of their own.
+ * Returns 0 on success, and -1 (having said why) on failure. */
+int tosh_coproc_send(struct tosh_coproc *c, char **args) {
+	sigset_t pipe_set, old_set, pending;
+	char *req;
+	int i, len = 0, size = COPROC_BUF_INC, sig;
+	ssize_t n;
+
+	if ((req = malloc(size * sizeof(char))) == NULL) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; args[i] != NULL; i++) {
+		n = strlen(args[i]);
+		if (len + n + 1 > size) {
+			size = len + n + 1 + COPROC_BUF_INC;
+			if ((req = realloc(req, size * sizeof(char))) == NULL) {
+				fprintf(stderr, "tosh: memory allocation failed. :(\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(&req[len], args[i], n);
+		len += n;
+		req[len++] = (args[i + 1] != NULL) ? ' ' : '\n';
+	}
+	if (len == 0)
+		req[len++] = '\n';
+
+	// If the helper has gone away, the write fails with EPIPE; hold back the SIGPIPE that
+	// comes with it (which would otherwise take the shell down too), and throw it away.
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	for (i = 0; i < len; i += n) {
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		if ((n = write(c->in_fd, &req[i], len - i)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	if (i < len && errno == EPIPE) {
+		sigpending(&pending);
+		if (sigismember(&pending, SIGPIPE))
+			sigwait(&pipe_set, &sig);
+		tosh_error("tosh: coprocess %s isn't listening any more. :(\n", c->name);
+	} else if (i < len) {
+		tosh_perror();
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	free(req);
+	return (i < len) ? -1 : 0;
+}
+
+/* Read lines (answers) from a helper and write them to stdout, waiting for them if need be.
+ * Returns 0 on success, and -1 if the helper stopped (or failed) before giving them all.
+ * A subshell (e.g. for `$(coproc read NAME)`) shares the helper's pipe with its parent, but not
+ * the buffer, so anything it read past the lines it wanted would be lost when it exited; so it
+ * reads a byte at a time, and never past the last newline it needs. For the same reason, it
+ * can't take answers its parent has already read but not handed out. */
+int tosh_coproc_read(struct tosh_coproc *c, long lines) {
+	char *nl;
+	int start = 0, sub = c->owner != getpid();
+	ssize_t n;
+
+	if (sub && c->len > 0) {
+		tosh_error("tosh: coprocess %s has answers waiting in the shell; `coproc read %s` them first. :(\n",
+				c->name, c->name);
+		return -1;
+	}
+
+	while (lines > 0) {
+		// Hand out any whole lines we already have.
+		if (c->len > start && (nl = memchr(&c->buf[start], '\n', c->len - start)) != NULL) {
+			fwrite(&c->buf[start], sizeof(char), nl + 1 - &c->buf[start], stdout);
+			start = nl + 1 - c->buf;
+			lines--;
+			continue;
+		}
+
+		// Otherwise, read some more (keeping whatever's left of a line).
+		if (start > 0) {
+			memmove(c->buf, &c->buf[start], c->len - start);
+			c->len -= start;
+			start = 0;
+		}
+		if (c->len + COPROC_BUF_INC > c->size) {
+			c->size = c->len + COPROC_BUF_INC;
+			if ((c->buf = realloc(c->buf, c->size * sizeof(char))) == NULL) {
+				fprintf(stderr, "tosh: memory allocation failed. :(\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		// (Whoever reads our output might be waiting on this answer before saying anything more.)
+		tosh_flush();
+		TOSH_COUNT(TOSH_SYS_READ);
+		if ((n = read(c->out_fd, &c->buf[c->len], sub ? 1 : c->size - c->len)) > 0) {
+			c->len += n;
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else {
+			// It's finished; an unfinished last line is still an answer.
+			if (c->len > 0) {
+				fwrite(c->buf, sizeof(char), c->len, stdout);
+				fputc('\n', stdout);
+				c->len = 0;
+				lines--;
+			}
+			if (n == -1)
+				tosh_perror();
+			if (lines > 0)
+				tosh_error("tosh: coprocess %s has stopped talking. :(\n", c->name);
+			return (lines > 0) ? -1 : 0;
+		}
+	}
+
+	if (start > 0) {
+		memmove(c->buf, &c->buf[start], c->len - start);
+		c->len -= start;
+	}
+	return 0;
+}
+
+/* Close a helper's stdin (so that it knows it's done), and wait for it to exit.
+ * Returns its exit status. */
+int tosh_coproc_stop(struct tosh_coproc *c) {
+	int status = 0;
+
+	tosh_fd_close(c->in_fd);
+	tosh_fd_close(c->out_fd);
+	do {
+		TOSH_COUNT(TOSH_SYS_WAIT);
+	} while (waitpid(c->pid, &status, 0) == -1 && errno == EINTR);
+	if (strcmp(TOSH_VERBOSE, "ON") == 0)
+		printf("[coprocess %s terminated with exit code %d]\n", c->name, status / 256);
+
+	free(c->name);
+	free(c->prog);
+	free(c->buf);
+	*c = TOSH_COPROCS[--TOSH_NUM_COPROCS];
+	return status;
+}
+
+/* Add the file descriptors of every helper to keep (a list terminated by -1), for a subshell
+ * which should be able to talk to them too. */
+void tosh_coproc_keep(int *keep) {
+	int i, n;
+
+	for (n = 0; keep[n] != -1; n++)
+		;
+	for (i = 0; i < TOSH_NUM_COPROCS; i++) {
+		keep[n++] = TOSH_COPROCS[i].in_fd;
+		keep[n++] = TOSH_COPROCS[i].out_fd;
+	}
+	keep[n] = -1;
+}
+
+/* Run a `coproc` command (args being whatever follows `coproc`):
+ *   coproc                            list the helpers running
+ *   coproc start NAME PROGRAM [ARGS]  start one
+ *   coproc send NAME [WORDS...]       send it a line
+ *   coproc read NAME [LINES]          write out its next line(s) of answer (one by default)
+ *   coproc ask NAME [WORDS...]        send it a line, then write out a line of answer
+ *   coproc stop NAME                  close its input and wait for it to exit
+ * Returns 0 on success, and 1 on failure. */
+int tosh_coproc_run(char **args) {
+	struct tosh_coproc *c;
+	long lines = 1;
+	int i;
+
+	if (args[0] == NULL) {
+		for (i = 0; i < TOSH_NUM_COPROCS; i++)
+			printf("%s\t%d\t%s\n", TOSH_COPROCS[i].name, TOSH_COPROCS[i].pid, TOSH_COPROCS[i].prog);
+		return 0;
+	}
+	if (args[1] == NULL || (strcmp(args[0], "start") == 0 && args[2] == NULL)) {
+		tosh_error("tosh: usage: coproc [start NAME PROGRAM [ARGS...] | send NAME [WORDS...] |"
+				" read NAME [LINES] | ask NAME [WORDS...] | stop NAME]\n");
+		return 1;
+	}
+	if (strcmp(args[0], "start") == 0)
+		return tosh_coproc_start(args[1], &args[2]) != 0;
+
+	if ((c = tosh_coproc_find(args[1])) == NULL) {
+		tosh_error("tosh: there's no coprocess called %s. :(\n", args[1]);
+		return 1;
+	}
+	if (strcmp(args[0], "send") == 0)
+		return tosh_coproc_send(c, &args[2]) != 0;
+	if (strcmp(args[0], "ask") == 0)
+		return tosh_coproc_send(c, &args[2]) != 0 || tosh_coproc_read(c, 1) != 0;
+	if (strcmp(args[0], "read") == 0) {
+		if (args[2] != NULL && (lines = atol(args[2])) < 1) {
+			tosh_error("tosh: usage: coproc read NAME [LINES]\n");
+			return 1;
+		}
+		return tosh_coproc_read(c, lines) != 0;
+	}
+	if (strcmp(args[0], "stop") == 0)
+		return tosh_coproc_stop(c) != 0;
+
+	tosh_error("tosh: I don't know how to %s a coprocess. :(\n", args[0]);
+	return 1;
+}
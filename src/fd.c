@@ -0,0 +1,116 @@
+/* File descriptor management.
+ * Everything the shell opens for itself is opened close-on-exec, and noted down here, so that
+ * the programs we run only get the file descriptors we mean them to (i.e. stdin, stdout and stderr)
+ * rather than, say, the history file or the other ends of our pipes. */
+
+#define _GNU_SOURCE /* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "tosh.h"
+
+// File descriptors owned by the shell itself (indexed by fd; we don't track any beyond this).
+#define TOSH_MAX_FDS 1024
+char TOSH_FD_OWNED[TOSH_MAX_FDS];
+
+/* Mark a file descriptor as close-on-exec, and note that the shell owns it.
+ * Returns 0 on success, and -1 on failure. */
+int tosh_fd_own(int fd) {
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return -1;
+	if (fd >= 0 && fd < TOSH_MAX_FDS)
+		TOSH_FD_OWNED[fd] = 1;
+	return 0;
+}
+
+/* Make a (close-on-exec) pipe owned by the shell. Same return values as pipe(). */
+int tosh_fd_pipe(int fds[2]) {
+	TOSH_COUNT(TOSH_SYS_PIPE);
+#ifdef __linux__
+	// (Atomically, where we can, so that a fork in another thread can't catch it half-made.)
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		return -1;
+#else
+	if (pipe(fds) == -1)
+		return -1;
+#endif
+	tosh_fd_own(fds[0]);
+	tosh_fd_own(fds[1]);
+	return 0;
+}
+
+/* Make a (close-on-exec) pair of connected Unix sockets owned by the shell.
+ * Same return values as socketpair(). */
+int tosh_fd_socketpair(int fds[2]) {
+	TOSH_COUNT(TOSH_SYS_PIPE);
+#ifdef SOCK_CLOEXEC
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+		return -1;
+#else
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return -1;
+#endif
+	tosh_fd_own(fds[0]);
+	tosh_fd_own(fds[1]);
+	return 0;
+}
+
+/* Open a (close-on-exec) file stream owned by the shell. Same return values as fopen(). */
+FILE *tosh_fd_fopen(char *path, char *mode) {
+	FILE *fp;
+
+	if ((fp = fopen(path, mode)) == NULL)
+		return NULL;
+	tosh_fd_own(fileno(fp));
+	return fp;
+}
+
+/* Close a file descriptor owned by the shell. Same return values as close(). */
+int tosh_fd_close(int fd) {
+	if (fd >= 0 && fd < TOSH_MAX_FDS)
+		TOSH_FD_OWNED[fd] = 0;
+	return close(fd);
+}
+
+/* Close a file stream owned by the shell. Same return values as fclose(). */
+int tosh_fd_fclose(FILE *fp) {
+	int fd = fileno(fp);
+
+	if (fd >= 0 && fd < TOSH_MAX_FDS)
+		TOSH_FD_OWNED[fd] = 0;
+	return fclose(fp);
+}
+
+/* Point target at (a copy of) the shell-owned file descriptor fd, and give up fd.
+ * The copy is *not* close-on-exec, since it is meant to be passed on. */
+int tosh_fd_move(int fd, int target) {
+	if (fd == target) {
+		if (fd < TOSH_MAX_FDS)
+			TOSH_FD_OWNED[fd] = 0;
+		return fcntl(fd, F_SETFD, 0);
+	}
+	if (dup2(fd, target) == -1)
+		return -1;
+	if (target < TOSH_MAX_FDS)
+		TOSH_FD_OWNED[target] = 0;
+	return tosh_fd_close(fd);
+}
+
+/* Close every file descriptor the shell owns except for those in keep (a list terminated by -1).
+ * For use in a forked child which is going to carry on as a shell, rather than exec something. */
+void tosh_fd_close_others(int *keep) {
+	int fd, i, kept;
+
+	for (fd = 0; fd < TOSH_MAX_FDS; fd++) {
+		if (!TOSH_FD_OWNED[fd])
+			continue;
+		for (i = kept = 0; keep[i] != -1; i++)
+			if (keep[i] == fd)
+				kept = 1;
+		if (!kept)
+			tosh_fd_close(fd);
+	}
+}
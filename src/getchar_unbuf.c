@@ -3,25 +3,41 @@
 #include <stdio.h>
 #include <unistd.h>
 
+// Whether stdin is a terminal, and if so, its settings (as we last found them).
+int TOSH_STDIN_TTY;
+struct termios TOSH_TTY_STATE;
+
+/* Find out whether stdin is a terminal (and how it's set up), so that we needn't keep asking.
+ * (Call again whenever something might have changed it, e.g. a program we've run.) */
+void tosh_tty_check(void) {
+	TOSH_COUNT(TOSH_SYS_TERMIOS);
+	TOSH_STDIN_TTY = tcgetattr(STDIN_FILENO, &TOSH_TTY_STATE) == 0;
+}
+
 /* An unbuffered equivalent of <stdio.h>'s getchar(). */
 int getchar_unbuf(void) {
-	// Make some termios structures.
-	struct termios old;
+	// Make a termios structure.
 	struct termios new;
+	int c;
+
+	// (Only a terminal has any settings to change.)
+	if (!TOSH_STDIN_TTY)
+		return getchar();
 
-	// Get attributes of terminal currently connected to stdin.
-	tcgetattr(STDIN_FILENO, &old);
-	new = old;
+	// Start from the attributes of the terminal connected to stdin.
+	new = TOSH_TTY_STATE;
 	// Modify flags.
 	//new.c_iflag = new.c_iflag & ~(ICANON | ECHO);
 	//new.c_iflag = new.c_iflag & ~(ICANON);
 	// Write back these changes (immediately).
 	tcsetattr(STDIN_FILENO, TCSANOW, &new);
+	TOSH_COUNT(TOSH_SYS_TERMIOS);
 	
 	// Get a character (now using this newly-configured terminal).
-	int c = getchar();
+	c = getchar();
 
 	// Revert to original attributes and return character.
-	tcsetattr(STDIN_FILENO, TCSANOW, &old);
+	tcsetattr(STDIN_FILENO, TCSANOW, &TOSH_TTY_STATE);
+	TOSH_COUNT(TOSH_SYS_TERMIOS);
 	return c;
 }
@@ -0,0 +1,83 @@
+/* String interning.
+ * Scripts say the same command names and options over and over; rather than each line
+ * keeping its own copy, the parser swaps them for a single shared (read-only) copy kept here.
+ * Two interned strings are then equal exactly when they are the same pointer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tosh.h"
+
+// Number of slots in the table (a power of two). We never fill it more than half way;
+// past that, strings just don't get interned (nothing breaks, they're only not shared).
+#define TOSH_INTERN_SIZE 4096
+
+char *TOSH_INTERN_TABLE[TOSH_INTERN_SIZE];
+int TOSH_INTERN_COUNT;
+
+// (The reader thread may be parsing when the main thread forks a subshell, which parses too.)
+pthread_mutex_t TOSH_INTERN_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t TOSH_INTERN_ONCE = PTHREAD_ONCE_INIT;
+
+void tosh_intern_lock(void) {
+	pthread_mutex_lock(&TOSH_INTERN_LOCK);
+}
+
+void tosh_intern_unlock(void) {
+	pthread_mutex_unlock(&TOSH_INTERN_LOCK);
+}
+
+/* Make sure nobody is halfway through using the table when we fork (or a subshell could
+ * inherit it locked, by a thread that doesn't exist there). */
+void tosh_intern_setup(void) {
+	pthread_atfork(tosh_intern_lock, tosh_intern_unlock, tosh_intern_unlock);
+}
+
+/* FNV-1a hash of the first len bytes of a string. */
+unsigned long tosh_intern_hash(char *str, int len) {
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) str[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+/* Find the slot for the first len bytes of str: either the one holding it, or the empty one
+ * where it would go. (Call with the lock held.) */
+char **tosh_intern_slot(char *str, int len) {
+	unsigned long i = tosh_intern_hash(str, len) & (TOSH_INTERN_SIZE - 1);
+	char **slot;
+
+	for (slot = &TOSH_INTERN_TABLE[i]; *slot != NULL; slot = &TOSH_INTERN_TABLE[i]) {
+		if (strncmp(*slot, str, len) == 0 && (*slot)[len] == '\0')
+			break;
+		i = (i + 1) & (TOSH_INTERN_SIZE - 1);
+	}
+	return slot;
+}
+
+/* Get the shared copy of the first len bytes of str (adding one if need be).
+ * Returns a null pointer if it couldn't be interned (the table is full, or out of memory);
+ * the string returned must never be modified or freed. */
+char *tosh_intern(char *str, int len) {
+	char **slot, *copy = NULL;
+
+	pthread_once(&TOSH_INTERN_ONCE, tosh_intern_setup);
+	pthread_mutex_lock(&TOSH_INTERN_LOCK);
+	slot = tosh_intern_slot(str, len);
+	if (*slot != NULL) {
+		copy = *slot;
+	} else if (TOSH_INTERN_COUNT < TOSH_INTERN_SIZE / 2 && (copy = malloc((len + 1) * sizeof(char))) != NULL) {
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+		*slot = copy;
+		TOSH_INTERN_COUNT++;
+	}
+	pthread_mutex_unlock(&TOSH_INTERN_LOCK);
+
+	return copy;
+}
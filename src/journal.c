@@ -0,0 +1,178 @@
+/* Journaling.
+ * With TOSH_JOURNAL set to a file, a script notes down there each line it has finished without
+ * anything failing (its line number, and a hash of the line). If it's stopped partway (say the
+ * machine goes down) and run again, the lines already done are skipped rather than run all over
+ * again; a line is only skipped if it's the same line in the same place as before, so an edited
+ * script carries on from the first edit. Once the script gets to the end, the journal is removed.
+ * Entries are written out (and synced to disk) a bunch at a time, rather than costing an fsync
+ * per line; so a crash can lose the last few, which are then run again. (A line is run at least
+ * once, not exactly once.) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "tosh.h"
+
+// Entries are synced once this many have built up, or once a line finishes this long (in
+// seconds) after the last sync, whichever comes first.
+#define JOURNAL_SYNC_LINES 64
+#define JOURNAL_SYNC_SECS 1
+
+#define JOURNAL_BUF_SIZE 4096
+#define JOURNAL_DONE_INC 1024
+
+// The journal (if we're keeping one), and the process keeping it (not any subshell of it).
+int TOSH_JOURNAL_FD = -1;
+char *TOSH_JOURNAL_PATH;
+pid_t TOSH_JOURNAL_PID;
+
+// The hash of each line done in an earlier run (or 0, if it wasn't), by line number.
+unsigned long long *TOSH_JOURNAL_DONE;
+long TOSH_JOURNAL_NUM_DONE;
+
+// Entries not yet written out (or not yet synced), and when we last synced.
+char TOSH_JOURNAL_BUF[JOURNAL_BUF_SIZE];
+int TOSH_JOURNAL_LEN, TOSH_JOURNAL_UNSYNCED;
+struct timespec TOSH_JOURNAL_SYNCED;
+
+/* FNV-1a hash of a line (never 0). */
+unsigned long long tosh_journal_hash(char *line) {
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (; *line != '\0'; line++) {
+		h ^= (unsigned char) *line;
+		h *= 1099511628211ULL;
+	}
+	return (h == 0) ? 1 : h;
+}
+
+/* Note that a line (with the given hash) was done in an earlier run. */
+void tosh_journal_note(long line_no, unsigned long long hash) {
+	long n;
+
+	if (line_no >= TOSH_JOURNAL_NUM_DONE) {
+		n = line_no + JOURNAL_DONE_INC;
+		if ((TOSH_JOURNAL_DONE = realloc(TOSH_JOURNAL_DONE, n * sizeof(unsigned long long))) == NULL) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(&TOSH_JOURNAL_DONE[TOSH_JOURNAL_NUM_DONE], 0, (n - TOSH_JOURNAL_NUM_DONE) * sizeof(unsigned long long));
+		TOSH_JOURNAL_NUM_DONE = n;
+	}
+	TOSH_JOURNAL_DONE[line_no] = hash;
+}
+
+/* Start journaling to the file at path, first reading in whatever an earlier run left there.
+ * Returns 0 on success, and -1 (having said why) on failure. */
+int tosh_journal_open(char *path) {
+	FILE *fp;
+	char entry[64];
+	unsigned long long hash;
+	long line_no;
+	int whole = 1;
+
+	// (The script may well `cd` somewhere else before we get to removing it.)
+	if ((path = tosh_abs_path(path)) == NULL) {
+		tosh_error("tosh: I couldn't open the journal. :(\n");
+		return -1;
+	}
+	if ((fp = fopen(path, "r")) != NULL) {
+		// (Anything we can't make sense of, e.g. an entry cut short by a crash, is ignored.)
+		while (fgets(entry, sizeof(entry), fp) != NULL) {
+			whole = strchr(entry, '\n') != NULL;
+			if (whole && sscanf(entry, "%ld %llx", &line_no, &hash) == 2 && line_no > 0 && hash != 0)
+				tosh_journal_note(line_no, hash);
+		}
+		fclose(fp);
+	}
+
+	if ((TOSH_JOURNAL_FD = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1 || tosh_fd_own(TOSH_JOURNAL_FD) == -1) {
+		tosh_perror();
+		tosh_error("tosh: I couldn't open the journal. :(\n");
+		TOSH_JOURNAL_FD = -1;
+		free(path);
+		return -1;
+	}
+	TOSH_JOURNAL_PATH = path;
+	TOSH_JOURNAL_PID = getpid();
+	clock_gettime(CLOCK_MONOTONIC, &TOSH_JOURNAL_SYNCED);
+
+	// (Start on a fresh line, if the last run was cut off halfway through one.)
+	if (!whole)
+		TOSH_JOURNAL_BUF[TOSH_JOURNAL_LEN++] = '\n';
+	atexit(tosh_journal_sync);
+	return 0;
+}
+
+/* Check whether we're keeping a journal (in this process). */
+int tosh_journal_active(void) {
+	return TOSH_JOURNAL_FD != -1 && TOSH_JOURNAL_PID == getpid();
+}
+
+/* Check whether a line was done (and noted down) in an earlier run. */
+int tosh_journal_done(long line_no, char *line) {
+	return tosh_journal_active() && line_no < TOSH_JOURNAL_NUM_DONE
+		&& TOSH_JOURNAL_DONE[line_no] == tosh_journal_hash(line);
+}
+
+/* Write out the entries we have so far, and make sure they're on disk. */
+void tosh_journal_sync(void) {
+	int i, n;
+
+	if (!tosh_journal_active())
+		return;
+	for (i = 0; i < TOSH_JOURNAL_LEN; i += n) {
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		if ((n = write(TOSH_JOURNAL_FD, &TOSH_JOURNAL_BUF[i], TOSH_JOURNAL_LEN - i)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			tosh_perror();
+			break;
+		}
+	}
+	TOSH_JOURNAL_LEN = 0;
+	if (TOSH_JOURNAL_UNSYNCED > 0) {
+		TOSH_COUNT(TOSH_SYS_FSYNC);
+#ifdef __APPLE__
+		fsync(TOSH_JOURNAL_FD);
+#else
+		fdatasync(TOSH_JOURNAL_FD);
+#endif
+	}
+	TOSH_JOURNAL_UNSYNCED = 0;
+	clock_gettime(CLOCK_MONOTONIC, &TOSH_JOURNAL_SYNCED);
+}
+
+/* Note down that a line has been done (syncing, if enough have built up, or enough time has
+ * gone by). */
+void tosh_journal_record(long line_no, char *line) {
+	struct timespec now;
+
+	if (!tosh_journal_active())
+		return;
+	if (TOSH_JOURNAL_LEN + 40 > JOURNAL_BUF_SIZE)
+		tosh_journal_sync();
+	TOSH_JOURNAL_LEN += sprintf(&TOSH_JOURNAL_BUF[TOSH_JOURNAL_LEN], "%ld %016llx\n", line_no, tosh_journal_hash(line));
+	TOSH_JOURNAL_UNSYNCED++;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (TOSH_JOURNAL_UNSYNCED >= JOURNAL_SYNC_LINES || now.tv_sec - TOSH_JOURNAL_SYNCED.tv_sec >= JOURNAL_SYNC_SECS)
+		tosh_journal_sync();
+}
+
+/* Stop journaling, the script having got to the end: nothing needs to be skipped next time. */
+void tosh_journal_finish(void) {
+	if (!tosh_journal_active())
+		return;
+	TOSH_JOURNAL_LEN = TOSH_JOURNAL_UNSYNCED = 0;
+	tosh_fd_close(TOSH_JOURNAL_FD);
+	TOSH_JOURNAL_FD = -1;
+	if (unlink(TOSH_JOURNAL_PATH) == -1)
+		tosh_perror();
+}
@@ -0,0 +1,256 @@
+/* Read-ahead for batch mode.
+ * When tosh is fed commands from a pipe or a file, a reader thread reads and splits
+ * the next few lines while the current command is running, so that the cost of
+ * parsing is hidden behind the child's runtime. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tosh.h"
+
+// A line that has been read (and split) ahead of time.
+struct tosh_batch_line {
+	char *line;
+	struct tosh_word *words;
+};
+
+// Queue of lines waiting to be executed (a ring buffer, filled by the reader thread).
+struct tosh_batch_line *TOSH_RA_QUEUE;
+int TOSH_RA_SIZE, TOSH_RA_HEAD, TOSH_RA_COUNT;
+int TOSH_RA_EOF;
+
+// Number of lines queued, and executed, so far; and the line we must wait for (if any)
+// before reading any further.
+long TOSH_RA_QUEUED, TOSH_RA_EXECUTED, TOSH_RA_PAUSE;
+
+pthread_mutex_t TOSH_RA_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t TOSH_RA_FILLED = PTHREAD_COND_INITIALIZER;
+pthread_cond_t TOSH_RA_DRAINED = PTHREAD_COND_INITIALIZER;
+
+// Whether either side is waiting on the other. Each wakes the other only if it's waiting, and
+// then only once the queue is half full (or half empty), rather than once per line, which would
+// cost two context switches a line.
+int TOSH_RA_READER_WAITING, TOSH_RA_EXEC_WAITING;
+
+// Buffer sizes for reading lines.
+#define RA_READ_SIZE 4096
+#define RA_LINE_BUF_INC 1024
+
+// Buffer of data read from stdin, but not yet split into lines.
+char TOSH_RA_RBUF[RA_READ_SIZE];
+int TOSH_RA_RPOS, TOSH_RA_RLEN;
+
+/* Wake the executor, if it's waiting and there are lines for it to get on with (as we're about to
+ * wait for more input, which might not come until it's run them). */
+void tosh_readahead_wake(void) {
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	if (TOSH_RA_EXEC_WAITING && TOSH_RA_COUNT > 0)
+		pthread_cond_signal(&TOSH_RA_FILLED);
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+}
+
+/* Read a line from stdin (without the newline), straight from the file descriptor
+ * (so that we don't hold any stdio locks while a command forks).
+ * Returns a dynamically allocated string, or a null pointer at EOF. */
+char *tosh_readahead_getline(void) {
+	char *rbuf = TOSH_RA_RBUF;
+	int i = 0, bufsize = RA_LINE_BUF_INC;
+	char c, *buf = malloc(bufsize * sizeof(char));
+
+	if (!buf) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		// Refill the read buffer if we've used it all.
+		if (TOSH_RA_RPOS >= TOSH_RA_RLEN) {
+			tosh_readahead_wake();
+			TOSH_RA_RPOS = 0;
+			TOSH_COUNT(TOSH_SYS_READ);
+			if ((TOSH_RA_RLEN = read(STDIN_FILENO, rbuf, RA_READ_SIZE)) <= 0) {
+				TOSH_RA_RLEN = 0;
+				if (i == 0) {
+					free(buf);
+					return NULL;
+				}
+				buf[i] = '\0';
+				return buf;
+			}
+		}
+		if ((c = rbuf[TOSH_RA_RPOS++]) == '\n' || c == '\0') {
+			buf[i] = '\0';
+			return buf;
+		}
+		buf[i++] = c;
+
+		// If we've exceeded the buffer (leaving room for the null byte)...
+		if (i + 1 >= bufsize) {
+			bufsize += RA_LINE_BUF_INC;
+			buf = realloc(buf, bufsize);
+			if (!buf) {
+				fprintf(stderr, "tosh: memory allocation failed. :(\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+/* Give back whatever we've read from stdin beyond the lines handed out so far, if we can
+ * (i.e. if stdin is a file, rather than a pipe), so that the next program to read it starts
+ * in the right place. */
+void tosh_readahead_unread(void) {
+	if (TOSH_RA_RPOS < TOSH_RA_RLEN && lseek(STDIN_FILENO, TOSH_RA_RPOS - TOSH_RA_RLEN, SEEK_CUR) != -1)
+		TOSH_RA_RPOS = TOSH_RA_RLEN = 0;
+}
+
+/* Body of the reader thread: read and split lines into the queue until EOF. */
+void *tosh_readahead_main(void *arg) {
+	char *line;
+	struct tosh_word *words;
+	struct tosh_batch_line *bl;
+
+	while (1) {
+		// Wait for a command that takes over stdin to finish before reading any more of it.
+		pthread_mutex_lock(&TOSH_RA_LOCK);
+		while (TOSH_RA_EXECUTED < TOSH_RA_PAUSE) {
+			TOSH_RA_READER_WAITING = 1;
+			pthread_cond_wait(&TOSH_RA_DRAINED, &TOSH_RA_LOCK);
+		}
+		TOSH_RA_READER_WAITING = 0;
+		pthread_mutex_unlock(&TOSH_RA_LOCK);
+
+		TOSH_PHASE = TOSH_PHASE_READ;
+		if ((line = tosh_readahead_getline()) == NULL)
+			break;
+		TOSH_PHASE = TOSH_PHASE_PARSE;
+		words = tosh_split_line(line);
+
+		pthread_mutex_lock(&TOSH_RA_LOCK);
+		// Wait for room in the queue.
+		while (TOSH_RA_COUNT >= TOSH_RA_SIZE) {
+			TOSH_RA_READER_WAITING = 1;
+			pthread_cond_wait(&TOSH_RA_DRAINED, &TOSH_RA_LOCK);
+		}
+		TOSH_RA_READER_WAITING = 0;
+
+		bl = &TOSH_RA_QUEUE[(TOSH_RA_HEAD + TOSH_RA_COUNT) % TOSH_RA_SIZE];
+		bl->line = line;
+		bl->words = words;
+		TOSH_RA_COUNT++;
+		TOSH_RA_QUEUED++;
+
+		// `exec` hands our stdin over to another program, so don't read any more of it
+		// until it's been run (in case it fails and we carry on).
+		if (words != NULL && strcmp(words[0].str, "exec") == 0) {
+			TOSH_RA_PAUSE = TOSH_RA_QUEUED;
+			tosh_readahead_unread();
+		}
+
+		// (If the executor is waiting, it can wait for a few more lines; tosh_readahead_wake()
+		// makes sure it isn't kept waiting on input that hasn't come yet.)
+		if (TOSH_RA_EXEC_WAITING && (TOSH_RA_COUNT > TOSH_RA_SIZE / 2 || TOSH_RA_PAUSE == TOSH_RA_QUEUED))
+			pthread_cond_signal(&TOSH_RA_FILLED);
+		pthread_mutex_unlock(&TOSH_RA_LOCK);
+	}
+
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	TOSH_RA_EOF = 1;
+	pthread_cond_signal(&TOSH_RA_FILLED);
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+	DEBUG_LOG("reader: reached EOF.", NULL)
+
+	return NULL;
+}
+
+/* Start reading (up to depth lines) ahead of the commands being executed.
+ * Returns 1 if the reader thread is running, and 0 if not (in which case we read as usual). */
+int tosh_readahead_start(int depth) {
+	pthread_t id;
+
+	// (With only the one CPU, the reader can't get anything done while a command runs; it would
+	// only add a couple of context switches every few lines.)
+	if (depth <= 0 || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		return 0;
+
+	TOSH_RA_QUEUE = malloc(depth * sizeof(struct tosh_batch_line));
+	if (!TOSH_RA_QUEUE) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	TOSH_RA_SIZE = depth;
+	TOSH_RA_HEAD = TOSH_RA_COUNT = 0;
+	TOSH_RA_EOF = 0;
+	TOSH_RA_QUEUED = TOSH_RA_EXECUTED = TOSH_RA_PAUSE = 0;
+
+	if (pthread_create(&id, NULL, tosh_readahead_main, NULL) != 0) {
+		tosh_error("tosh: I couldn't start reading ahead. :(\n");
+		free(TOSH_RA_QUEUE);
+		return 0;
+	}
+	pthread_detach(id);
+	DEBUG_LOG("reading up to %d lines ahead.", depth)
+
+	return 1;
+}
+
+/* Take the next line from the queue (waiting for it to be read, if need be), along with its
+ * words (which may be a null pointer, as for tosh_split_line()).
+ * Returns a null pointer once there are no lines left. */
+char *tosh_readahead_next(struct tosh_word **words) {
+	char *line = NULL;
+
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	while (TOSH_RA_COUNT == 0 && !TOSH_RA_EOF) {
+		TOSH_RA_EXEC_WAITING = 1;
+		pthread_cond_wait(&TOSH_RA_FILLED, &TOSH_RA_LOCK);
+	}
+	TOSH_RA_EXEC_WAITING = 0;
+
+	if (TOSH_RA_COUNT > 0) {
+		line = TOSH_RA_QUEUE[TOSH_RA_HEAD].line;
+		*words = TOSH_RA_QUEUE[TOSH_RA_HEAD].words;
+		TOSH_RA_HEAD = (TOSH_RA_HEAD + 1) % TOSH_RA_SIZE;
+		TOSH_RA_COUNT--;
+		if (TOSH_RA_READER_WAITING && TOSH_RA_COUNT <= TOSH_RA_SIZE / 2)
+			pthread_cond_signal(&TOSH_RA_DRAINED);
+	}
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+
+	return line;
+}
+
+/* Signal that the line last taken from the queue has been executed. */
+void tosh_readahead_done(void) {
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	TOSH_RA_EXECUTED++;
+	if (TOSH_RA_READER_WAITING && TOSH_RA_EXECUTED == TOSH_RA_PAUSE)
+		pthread_cond_signal(&TOSH_RA_DRAINED);
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+}
+
+/* Check whether the next line is ready to be taken from the queue (or there are no more to come),
+ * so that taking it won't have to wait. */
+int tosh_readahead_ready(void) {
+	int ready;
+
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	ready = TOSH_RA_COUNT > 0 || TOSH_RA_EOF;
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+
+	return ready;
+}
+
+/* Check whether the reader has reached EOF and every line has been taken from the queue
+ * (without waiting for the reader to get there). */
+int tosh_readahead_finished(void) {
+	int finished;
+
+	pthread_mutex_lock(&TOSH_RA_LOCK);
+	finished = TOSH_RA_EOF && TOSH_RA_COUNT == 0;
+	pthread_mutex_unlock(&TOSH_RA_LOCK);
+
+	return finished;
+}
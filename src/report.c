@@ -0,0 +1,239 @@
+/* Per-line reports.
+ * With TOSH_REPORT set, a script keeps track of where its time goes: for each line, how long it
+ * took (wall time, from after it was read to when it finished), how much CPU the programs it ran
+ * used (as wait4() tells us when we wait for them), and how the last of them to fail exited.
+ * When the script finishes, the slowest few lines are written to stderr (TOSH_REPORT being a
+ * number, or `ON` for ten), or every line is written to a file (TOSH_REPORT being a path ending
+ * in `.csv` or `.json`). It costs a couple of clock_gettime() calls per line. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "tosh.h"
+
+#define REPORT_DEFAULT_TOP 10
+#define REPORT_LINES_INC 1024
+
+#define REPORT_TOP  0
+#define REPORT_CSV  1
+#define REPORT_JSON 2
+
+// What we know about a line (summed over however many times it ran).
+struct tosh_report_line {
+	char *line;
+	long runs;
+	double wall, cpu;
+	int status;
+};
+
+// Whether (and how) we're reporting, and in which process (not any subshell of it).
+int TOSH_REPORT_ACTIVE;
+int TOSH_REPORT_FORMAT, TOSH_REPORT_TOP;
+char *TOSH_REPORT_PATH;
+pid_t TOSH_REPORT_PID;
+
+// Lines seen so far, by line number.
+struct tosh_report_line *TOSH_REPORT_LINES;
+long TOSH_REPORT_NUM_LINES;
+
+// The line being run: when it started, the CPU used by what it's run so far, and its exit code.
+// (The exit code is kept track of even when we're not reporting, since the journal needs it.)
+struct timespec TOSH_REPORT_START;
+double TOSH_REPORT_CPU;
+int TOSH_REPORT_STATUS;
+
+/* Start reporting, as TOSH_REPORT says (see above). Returns 0 on success, and -1 (having said
+ * why) if it doesn't make sense. */
+int tosh_report_open(char *how) {
+	char *end;
+	int len = strlen(how);
+
+	if (strcmp(how, "ON") == 0) {
+		TOSH_REPORT_FORMAT = REPORT_TOP;
+		TOSH_REPORT_TOP = REPORT_DEFAULT_TOP;
+	} else if (isdigit((unsigned char) how[0])) {
+		TOSH_REPORT_FORMAT = REPORT_TOP;
+		if ((TOSH_REPORT_TOP = strtol(how, &end, 10)) <= 0 || *end != '\0') {
+			tosh_error("tosh: TOSH_REPORT should be OFF, ON, a number of lines, or a .csv or .json file. :(\n");
+			return -1;
+		}
+	} else if (len > 4 && strcmp(&how[len - 4], ".csv") == 0) {
+		TOSH_REPORT_FORMAT = REPORT_CSV;
+	} else if (len > 5 && strcmp(&how[len - 5], ".json") == 0) {
+		TOSH_REPORT_FORMAT = REPORT_JSON;
+	} else {
+		tosh_error("tosh: TOSH_REPORT should be OFF, ON, a number of lines, or a .csv or .json file. :(\n");
+		return -1;
+	}
+
+	// (It's written at the end, by when the script may well have `cd`'d somewhere else.)
+	if (TOSH_REPORT_FORMAT != REPORT_TOP && (TOSH_REPORT_PATH = tosh_abs_path(how)) == NULL) {
+		tosh_error("tosh: I couldn't write the report. :(\n");
+		return -1;
+	}
+	TOSH_REPORT_ACTIVE = 1;
+	TOSH_REPORT_PID = getpid();
+	atexit(tosh_report_write);
+	return 0;
+}
+
+/* Check whether we're reporting (in this process). */
+int tosh_report_active(void) {
+	return TOSH_REPORT_ACTIVE && TOSH_REPORT_PID == getpid();
+}
+
+/* Note that a line is starting. */
+void tosh_report_start(void) {
+	TOSH_REPORT_STATUS = 0;
+	if (!tosh_report_active())
+		return;
+	TOSH_REPORT_CPU = 0;
+	clock_gettime(CLOCK_MONOTONIC, &TOSH_REPORT_START);
+}
+
+/* Count a child the line has waited for: its resource usage, and (unless status is null, e.g.
+ * for a subshell doing a substitution) how it exited. */
+void tosh_report_child(struct rusage *usage, int *status) {
+	int code;
+
+	if (status != NULL) {
+		// (As shells put it: killed by a signal is 128 plus the signal.)
+		code = WIFSIGNALED(*status) ? 128 + WTERMSIG(*status) : WEXITSTATUS(*status);
+		if (code != 0)
+			TOSH_REPORT_STATUS = code;
+	}
+	if (!tosh_report_active())
+		return;
+	TOSH_REPORT_CPU += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6
+		+ usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+/* Note that the line failed other than by a child exiting (e.g. a program that couldn't be
+ * started), with the given exit code. */
+void tosh_report_fail(int code) {
+	TOSH_REPORT_STATUS = code;
+}
+
+/* The exit code of the line being run, so far (0 unless something it ran failed). */
+int tosh_report_status(void) {
+	return TOSH_REPORT_STATUS;
+}
+
+/* Note that a line (of the script, numbered line_no) has finished. */
+void tosh_report_end(long line_no, char *line) {
+	struct tosh_report_line *r;
+	struct timespec now;
+	long n;
+
+	if (!tosh_report_active())
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (line_no >= TOSH_REPORT_NUM_LINES) {
+		n = line_no + REPORT_LINES_INC;
+		if ((TOSH_REPORT_LINES = realloc(TOSH_REPORT_LINES, n * sizeof(struct tosh_report_line))) == NULL) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(&TOSH_REPORT_LINES[TOSH_REPORT_NUM_LINES], 0, (n - TOSH_REPORT_NUM_LINES) * sizeof(struct tosh_report_line));
+		TOSH_REPORT_NUM_LINES = n;
+	}
+	r = &TOSH_REPORT_LINES[line_no];
+	if (r->line == NULL && (r->line = malloc((strlen(line) + 1) * sizeof(char))) != NULL)
+		strcpy(r->line, line);
+	r->runs++;
+	r->wall += (now.tv_sec - TOSH_REPORT_START.tv_sec) + (now.tv_nsec - TOSH_REPORT_START.tv_nsec) / 1e9;
+	r->cpu += TOSH_REPORT_CPU;
+	if (TOSH_REPORT_STATUS != 0 || r->runs == 1)
+		r->status = TOSH_REPORT_STATUS;
+}
+
+/* Compare lines by wall time (slowest first), for qsort(). */
+int tosh_report_slower(const void *a, const void *b) {
+	const struct tosh_report_line *x = *(struct tosh_report_line * const *) a;
+	const struct tosh_report_line *y = *(struct tosh_report_line * const *) b;
+
+	return (x->wall < y->wall) - (x->wall > y->wall);
+}
+
+/* Write a line of the script as a quoted (CSV or JSON) string. */
+void tosh_report_quote(FILE *fp, char *str, int format) {
+	fputc('"', fp);
+	for (; *str != '\0'; str++) {
+		if (*str == '"')
+			fputs((format == REPORT_CSV) ? "\"\"" : "\\\"", fp);
+		else if (format == REPORT_JSON && *str == '\\')
+			fputs("\\\\", fp);
+		else if (format == REPORT_JSON && (unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char) *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+/* Write out the report (when the script has finished). */
+void tosh_report_write(void) {
+	struct tosh_report_line **top;
+	FILE *fp;
+	long i, n;
+
+	if (!tosh_report_active())
+		return;
+	TOSH_REPORT_ACTIVE = 0;
+
+	if (TOSH_REPORT_FORMAT == REPORT_TOP) {
+		// (After whatever the script itself wrote.)
+		tosh_flush();
+		if ((top = malloc((TOSH_REPORT_NUM_LINES + 1) * sizeof(struct tosh_report_line *))) == NULL) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+		for (n = 0, i = 0; i < TOSH_REPORT_NUM_LINES; i++)
+			if (TOSH_REPORT_LINES[i].runs > 0)
+				top[n++] = &TOSH_REPORT_LINES[i];
+		qsort(top, n, sizeof(struct tosh_report_line *), tosh_report_slower);
+		if (n > TOSH_REPORT_TOP)
+			n = TOSH_REPORT_TOP;
+
+		fprintf(stderr, "tosh: the %ld slowest lines ⤵︎\n", n);
+		fprintf(stderr, "%6s %10s %10s %5s  %s\n", "line", "wall (s)", "cpu (s)", "exit", "command");
+		for (i = 0; i < n; i++)
+			fprintf(stderr, "%6ld %10.3f %10.3f %5d  %s\n", (long) (top[i] - TOSH_REPORT_LINES),
+					top[i]->wall, top[i]->cpu, top[i]->status, top[i]->line ? top[i]->line : "");
+		free(top);
+		return;
+	}
+
+	if ((fp = fopen(TOSH_REPORT_PATH, "w")) == NULL) {
+		tosh_perror();
+		tosh_error("tosh: I couldn't write the report. :(\n");
+		return;
+	}
+	if (TOSH_REPORT_FORMAT == REPORT_CSV)
+		fprintf(fp, "line,runs,wall_seconds,cpu_seconds,exit_code,command\n");
+	else
+		fprintf(fp, "[");
+	for (n = 0, i = 0; i < TOSH_REPORT_NUM_LINES; i++) {
+		if (TOSH_REPORT_LINES[i].runs == 0)
+			continue;
+		if (TOSH_REPORT_FORMAT == REPORT_CSV)
+			fprintf(fp, "%ld,%ld,%.6f,%.6f,%d,", i, TOSH_REPORT_LINES[i].runs, TOSH_REPORT_LINES[i].wall,
+					TOSH_REPORT_LINES[i].cpu, TOSH_REPORT_LINES[i].status);
+		else
+			fprintf(fp, "%s\n  {\"line\": %ld, \"runs\": %ld, \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, "
+					"\"exit_code\": %d, \"command\": ", (n++ > 0) ? "," : "", i, TOSH_REPORT_LINES[i].runs,
+					TOSH_REPORT_LINES[i].wall, TOSH_REPORT_LINES[i].cpu, TOSH_REPORT_LINES[i].status);
+		tosh_report_quote(fp, TOSH_REPORT_LINES[i].line ? TOSH_REPORT_LINES[i].line : "", TOSH_REPORT_FORMAT);
+		fprintf(fp, (TOSH_REPORT_FORMAT == REPORT_CSV) ? "\n" : "}");
+	}
+	if (TOSH_REPORT_FORMAT == REPORT_JSON)
+		fprintf(fp, "\n]\n");
+	if (fclose(fp) == EOF)
+		tosh_perror();
+}
@@ -0,0 +1,219 @@
+/* Sorting strings.
+ * Glob matches are sorted with an MSD radix sort: the strings are put into buckets by their first
+ * byte, then each bucket by the next byte, and so on, so that each byte is looked at about once
+ * (rather than comparing whole strings over and over, as qsort() does). Long lists are split
+ * between several threads, which bucket them by the first byte that differs together, then take
+ * the buckets between them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tosh.h"
+
+// Lists shorter than this get an insertion sort instead; longer than this get several threads.
+#define SORT_SMALL 32
+#define SORT_PARALLEL 65536
+#define SORT_MAX_THREADS 8
+
+// A parallel sort: the strings (and scratch space for as many), the byte they're being
+// bucketed by, and each bucket's place and size.
+struct tosh_sort {
+	char **strs, **tmp;
+	long num;
+	int depth, num_threads, next_bucket;
+	long starts[256], counts[256];
+	pthread_mutex_t lock;
+};
+
+// One thread's share of a parallel sort: a chunk of the strings, and its counts of their bytes.
+struct tosh_sort_thread {
+	struct tosh_sort *s;
+	pthread_t id;
+	long from, to;
+	long counts[256];
+};
+
+/* Sort a few strings which are known to be the same up to depth. */
+void tosh_sort_insertion(char **strs, long num, int depth) {
+	char *t;
+	long i, j;
+
+	for (i = 1; i < num; i++) {
+		t = strs[i];
+		for (j = i; j > 0 && strcmp(strs[j - 1] + depth, t + depth) > 0; j--)
+			strs[j] = strs[j - 1];
+		strs[j] = t;
+	}
+}
+
+/* Sort strings which are known to be the same up to depth, using tmp (room for as many) as scratch. */
+void tosh_sort_radix(char **strs, char **tmp, long num, int depth) {
+	long counts[256], starts[256], i, biggest;
+	int b, big;
+
+	while (num >= SORT_SMALL) {
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < num; i++)
+			counts[(unsigned char) strs[i][depth]]++;
+
+		// If they all have the same byte here, there's nothing to move.
+		if ((b = (unsigned char) strs[0][depth]) != 0 && counts[b] == num) {
+			depth++;
+			continue;
+		}
+
+		for (starts[0] = 0, b = 1; b < 256; b++)
+			starts[b] = starts[b - 1] + counts[b - 1];
+		for (i = 0; i < num; i++)
+			tmp[starts[(unsigned char) strs[i][depth]]++] = strs[i];
+		memcpy(strs, tmp, num * sizeof(char *));
+
+		// Strings that end here are all the same; the rest are sorted on their next byte, the
+		// biggest bucket last (by going round again, so that we never recurse very deep).
+		for (big = 1, biggest = 0, b = 1; b < 256; b++) {
+			if (counts[b] > biggest) {
+				biggest = counts[b];
+				big = b;
+			}
+		}
+		for (b = 1; b < 256; b++) {
+			if (b != big && counts[b] > 1)
+				tosh_sort_radix(&strs[starts[b] - counts[b]], &tmp[starts[b] - counts[b]], counts[b], depth + 1);
+		}
+		strs = &strs[starts[big] - counts[big]];
+		tmp = &tmp[starts[big] - counts[big]];
+		num = counts[big];
+		depth++;
+	}
+	tosh_sort_insertion(strs, num, depth);
+}
+
+/* Count the bytes (at the current depth) of a thread's chunk of strings. */
+void *tosh_sort_count(void *arg) {
+	struct tosh_sort_thread *t = arg;
+	long i;
+
+	memset(t->counts, 0, sizeof(t->counts));
+	for (i = t->from; i < t->to; i++)
+		t->counts[(unsigned char) t->s->strs[i][t->s->depth]]++;
+	return NULL;
+}
+
+/* Put a thread's chunk of strings into their buckets (in tmp); its counts have been turned into
+ * where its share of each bucket starts. */
+void *tosh_sort_scatter(void *arg) {
+	struct tosh_sort_thread *t = arg;
+	long i;
+
+	for (i = t->from; i < t->to; i++)
+		t->s->tmp[t->counts[(unsigned char) t->s->strs[i][t->s->depth]]++] = t->s->strs[i];
+	return NULL;
+}
+
+/* Take buckets (from tmp) and sort them, until there are none left, putting them back in strs. */
+void *tosh_sort_buckets(void *arg) {
+	struct tosh_sort_thread *t = arg;
+	struct tosh_sort *s = t->s;
+	long start, num;
+	int b;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		b = s->next_bucket++;
+		pthread_mutex_unlock(&s->lock);
+		if (b >= 256)
+			return NULL;
+		start = s->starts[b];
+		num = s->counts[b];
+		// (Strings that end here, in bucket 0, are all the same.)
+		if (b != 0 && num > 1)
+			tosh_sort_radix(&s->tmp[start], &s->strs[start], num, s->depth + 1);
+		memcpy(&s->strs[start], &s->tmp[start], num * sizeof(char *));
+	}
+}
+
+/* Run fn in each of the threads (the first of them being this one), and wait for them all.
+ * (If a thread can't be started, this one does its share as well.) */
+void tosh_sort_run(struct tosh_sort_thread *threads, int num, void *(*fn)(void *)) {
+	int i;
+
+	for (i = 1; i < num; i++) {
+		if (pthread_create(&threads[i].id, NULL, fn, &threads[i]) != 0)
+			threads[i].id = pthread_self();
+	}
+	fn(&threads[0]);
+	for (i = 1; i < num; i++) {
+		if (pthread_equal(threads[i].id, pthread_self()))
+			fn(&threads[i]);
+		else
+			pthread_join(threads[i].id, NULL);
+	}
+}
+
+/* Sort a list of strings into byte order (as strcmp() would). */
+void tosh_sort_strings(char **strs, long num) {
+	struct tosh_sort s;
+	struct tosh_sort_thread threads[SORT_MAX_THREADS];
+	long pos, n;
+	int i, b;
+
+	if (num < 2)
+		return;
+	if (num < SORT_PARALLEL || (s.num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 2) {
+		if ((s.tmp = malloc(num * sizeof(char *))) == NULL) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+		tosh_sort_radix(strs, s.tmp, num, 0);
+		free(s.tmp);
+		return;
+	}
+
+	if (s.num_threads > SORT_MAX_THREADS)
+		s.num_threads = SORT_MAX_THREADS;
+	if ((s.tmp = malloc(num * sizeof(char *))) == NULL) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	s.strs = strs;
+	s.num = num;
+	s.next_bucket = 0;
+	pthread_mutex_init(&s.lock, NULL);
+	for (i = 0; i < s.num_threads; i++) {
+		threads[i].s = &s;
+		threads[i].from = num * i / s.num_threads;
+		threads[i].to = num * (i + 1) / s.num_threads;
+	}
+
+	// Skip whatever they all start with (paths often have a lot in common), and count the first
+	// byte that differs.
+	s.depth = strlen(strs[0]);
+	for (pos = 1; pos < num; pos++)
+		for (i = 0; i < s.depth; i++)
+			if (strs[pos][i] != strs[0][i])
+				s.depth = i;
+	tosh_sort_run(threads, s.num_threads, tosh_sort_count);
+	memset(s.counts, 0, sizeof(s.counts));
+	for (i = 0; i < s.num_threads; i++)
+		for (b = 0; b < 256; b++)
+			s.counts[b] += threads[i].counts[b];
+
+	if (s.counts[0] < num) {
+		// Work out where each thread's share of each bucket goes, then put them there.
+		for (pos = b = 0; b < 256; b++) {
+			s.starts[b] = pos;
+			for (i = 0; i < s.num_threads; i++) {
+				n = threads[i].counts[b];
+				threads[i].counts[b] = pos;
+				pos += n;
+			}
+		}
+		tosh_sort_run(threads, s.num_threads, tosh_sort_scatter);
+		tosh_sort_run(threads, s.num_threads, tosh_sort_buckets);
+	}
+
+	pthread_mutex_destroy(&s.lock);
+	free(s.tmp);
+}
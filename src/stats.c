@@ -0,0 +1,67 @@
+/* Syscall counting.
+ * The places where the shell itself makes syscalls count them here (by phase of the main loop),
+ * so that the `stats` builtin can show how many we're making without needing strace. */
+
+#include <stdio.h>
+#include "tosh.h"
+
+// Counts of syscalls made, by phase and by kind (by every thread; see TOSH_COUNT()).
+atomic_long TOSH_SYSCALLS[TOSH_NUM_PHASES][TOSH_NUM_SYSCALLS];
+
+// The phase the current thread is in (the reader thread has its own).
+_Thread_local int TOSH_PHASE = TOSH_PHASE_STARTUP;
+
+char *tosh_phase_str[] = {
+	"startup",
+	"prompt",
+	"read",
+	"parse",
+	"expand",
+	"execute"
+};
+
+char *tosh_syscall_str[] = {
+	"read",
+	"write",
+	"fork",
+	"exec",
+	"wait",
+	"pipe",
+	"termios",
+	"getcwd",
+	"chdir",
+	"opendir",
+	"stat",
+	"getdents",
+	"fsync"
+};
+
+/* Print a table of the syscalls made so far, with a column for each phase. */
+void tosh_stats_show(void) {
+	int p, s;
+	long n, total;
+
+	printf("%-10s", "syscall");
+	for (p = 0; p < TOSH_NUM_PHASES; p++)
+		printf("%10s", tosh_phase_str[p]);
+	printf("%10s\n", "total");
+
+	for (s = 0; s < TOSH_NUM_SYSCALLS; s++) {
+		printf("%-10s", tosh_syscall_str[s]);
+		for (total = p = 0; p < TOSH_NUM_PHASES; p++) {
+			n = atomic_load_explicit(&TOSH_SYSCALLS[p][s], memory_order_relaxed);
+			printf("%10ld", n);
+			total += n;
+		}
+		printf("%10ld\n", total);
+	}
+}
+
+/* Forget about all the syscalls made so far. */
+void tosh_stats_reset(void) {
+	int p, s;
+
+	for (p = 0; p < TOSH_NUM_PHASES; p++)
+		for (s = 0; s < TOSH_NUM_SYSCALLS; s++)
+			atomic_store_explicit(&TOSH_SYSCALLS[p][s], 0, memory_order_relaxed);
+}
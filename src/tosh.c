@@ -5,11 +5,24 @@
 #include <unistd.h> /* POSIX syscall stuff */
 #include <string.h> /* strtok() and strcmp() */
 #include <sys/wait.h> /* waitpid() */
+#include <spawn.h> /* posix_spawnp() */
+#include <sys/stat.h> /* fstat() */
+#include <sys/resource.h> /* wait4() */
 #include <signal.h> /* signal(), various macros, etc. */
-#include <glob.h>
 #include <ctype.h>
+#include <stdarg.h> /* va_list, etc. */
+#include <errno.h>
+#ifndef __APPLE__
+#include <stdio_ext.h> /* __fpurge(), __fpending() */
+#define fpurge __fpurge
+#define fpending __fpending
+#else
+#define fpending(fp) 1 /* (we can't tell, so assume there's something) */
+#endif
 #include "tosh.h"
 
+extern char **environ;
+
 // Various global constants
 #define TOSH_MAX_PROMPT        128
 #define TOSH_MAX_CHILD         128
@@ -20,28 +33,24 @@
 // <limits.h> on POSIX systems, but on macOS there either
 // isn't a limit or it isn't defined in this way.)
 
-// Colours
-#define RED    "\x1B[31m"
-#define GRN    "\x1B[32m"
-#define YEL    "\x1B[33m"
-#define BLU    "\x1B[34m"
-#define MAG    "\x1B[35m"
-#define CYN    "\x1B[36m"
-#define WHT    "\x1B[37m"
-#define BLD    "\033[1m"
-#define BLDRS  "\033[0m"
-#define RESET  "\x1B[0m"
+// Global history file stream
+FILE *TOSH_HIST_FILE;
 
+// The matches of the last glob pattern
+char **TOSH_GLOB_MATCHES;
 
-#define DEBUG_LOG(A, ...) if (strcmp(TOSH_DEBUG, "ON") == 0) {\
-			  	fprintf(stderr, BLD "log: " A BLDRS "\n", __VA_ARGS__);\
-			  }	
+// How we were started (for starting workers)
+char *TOSH_SELF = "tosh";
 
-// Global history file stream
-FILE *TOSH_HIST_FILE;
+// Whether lines are being read (and split) ahead of time by a reader thread
+int TOSH_BATCH;
 
-// Pointer to the global struct used for receiving globbing information
-glob_t *TOSH_GLOB_STRUCT_PTR;
+// Whether to behave interactively, i.e. show a prompt (stdin is a terminal, or TOSH_FORCE_INTERACTIVE
+// is on); worked out at startup, and again only if TOSH_FORCE_INTERACTIVE changes
+int TOSH_INTERACTIVE;
+
+// Whether the command being run is the last thing the shell will do (so we needn't fork to run it)
+int TOSH_LAST_COMMAND;
 
 // (Chronologically) previous directory
 char TOSH_LAST_DIR[TOSH_MAX_PATH]; // [note: 256 bytes is the max length of a dirname in Unix]
@@ -69,6 +78,11 @@ char *TOSH_HIST_LEN = "10000";
 char *TOSH_CONFIG_PATH = "~/.toshrc";
 char *TOSH_DEBUG = "OFF";
 char *TOSH_FORCE_INTERACTIVE = "OFF";
+char *TOSH_READAHEAD = "16";
+char *TOSH_GLOB_IGNORE = "OFF";
+char *TOSH_GLOB_LOCALE = "OFF";
+char *TOSH_JOURNAL = "OFF";
+char *TOSH_REPORT = "OFF";
 char *ENV_PATH;
 char *ENV_MANPATH;
 char *ENV_SHLVL;
@@ -81,6 +95,11 @@ char *glob_vars_str[] = {
 	"TOSH_CONFIG_PATH",
 	"TOSH_DEBUG",
 	"TOSH_FORCE_INTERACTIVE",
+	"TOSH_READAHEAD",
+	"TOSH_GLOB_IGNORE",
+	"TOSH_GLOB_LOCALE",
+	"TOSH_JOURNAL",
+	"TOSH_REPORT",
 	"PATH",
 	"MANPATH",
 	"SHLVL"
@@ -92,6 +111,11 @@ char **glob_vars[] = {
 	&TOSH_CONFIG_PATH,
 	&TOSH_DEBUG,
 	&TOSH_FORCE_INTERACTIVE,
+	&TOSH_READAHEAD,
+	&TOSH_GLOB_IGNORE,
+	&TOSH_GLOB_LOCALE,
+	&TOSH_JOURNAL,
+	&TOSH_REPORT,
 	&ENV_PATH,
 	&ENV_MANPATH,
 	&ENV_SHLVL
@@ -109,6 +133,9 @@ char *builtin_str[] = {
 	"exec",
 	"readconfig",
 	"help",
+	"stats",
+	"batch",
+	"coproc",
 	"quit" };
 
 // Forward declarations of builtins, and pointers to them.
@@ -117,6 +144,9 @@ int tosh_showenv(char **);
 int tosh_exec(char **);
 int tosh_readconfig(char **);
 int tosh_help(char **);
+int tosh_stats(char **);
+int tosh_batch(char **);
+int tosh_coproc(char **);
 int tosh_quit(char **);
 int (*builtin_func[]) (char **) = {
 	&tosh_cd,
@@ -124,6 +154,9 @@ int (*builtin_func[]) (char **) = {
 	&tosh_exec,
 	&tosh_readconfig,
 	&tosh_help,
+	&tosh_stats,
+	&tosh_batch,
+	&tosh_coproc,
 	&tosh_quit
 };
 
@@ -138,12 +171,22 @@ void tosh_parse_args(int, char **);
 void tosh_bind_signals(void);
 void tosh_open_hist(void);
 void tosh_close_hist(void);
+void tosh_open_journal(void);
+void tosh_open_report(void);
 void tosh_sync_env_vars(void);
 void tosh_load_config(void);
 void tosh_init(void);
 
 
+// Size of the buffer for the shell's own output.
+#define OUT_BUF_SIZE 65536
+
+#ifndef TOSH_FUZZ
 int main(int argc, char **argv) {
+	// Buffer up our own output (builtins, verbose messages, etc.) rather than writing it a line
+	// at a time; it's written out by tosh_flush() whenever anything else might write too.
+	setvbuf(stdout, NULL, _IOFBF, OUT_BUF_SIZE);
+
 	// Parse (external) arguments to tosh.
 	tosh_parse_args(argc, argv);
 
@@ -162,68 +205,189 @@ int main(int argc, char **argv) {
 	// Open history file.
 	tosh_open_hist();
 
+	// Keep a journal of the lines we get through, and track where the time goes (if asked to).
+	tosh_open_journal();
+	tosh_open_report();
+
+	// If we're being fed a batch of commands (from a pipe or a file), read ahead.
+	if (!TOSH_INTERACTIVE)
+		TOSH_BATCH = tosh_readahead_start(atoi(TOSH_READAHEAD));
+
 	// Run command loop.
 	tosh_loop(1);
 
+	// We got to the end, so there's nothing to pick up from next time.
+	tosh_journal_finish();
+
 	// Close history file.
 	tosh_close_hist();
 
 	// GREAT SUCCESS!!!
 	return EXIT_SUCCESS;
 }
+#endif
 
 // Forward declarations for tosh_loop()
 char *tosh_read_line(void);
-char **tosh_split_line(char *);
-//char **tosh_split_line_new(char *);
-int tosh_execute(char **);
+int tosh_execute(char **, char *);
 void tosh_prompt(void);
-char **tosh_expand_args(char **);
+char **tosh_expand_args(struct tosh_word *);
 void tosh_sync_env_vars(void);
 void tosh_record_line(char *);
 void tosh_glob_free(void);
+int tosh_input_finished(void);
+int tosh_journal_skippable(struct tosh_word *);
+char *tosh_word_name(struct tosh_word *);
 
 /* The main loop: get command line, interpret and act on it, repeat. */
 void tosh_loop(int loop) {
 	char *line;
-	char **args;
-	int status, i;
+	char **args, *name;
+	struct tosh_word *words;
+	int status = 1, journal = loop && tosh_journal_active(), report = loop && tosh_report_active();
+	long line_no = 0;
 
 	do {
-		// Show the prompt (if we're talking to a tty).
-		if (isatty(fileno(stdin)) || strcmp(TOSH_FORCE_INTERACTIVE, "ON") == 0)
-			tosh_prompt();
+		if (loop && TOSH_BATCH) {
+			// Take the next line (already split into words) from the reader thread.
+			// (If we'll have to wait for it, let whoever's reading our output have it first.)
+			TOSH_PHASE = TOSH_PHASE_READ;
+			if (!tosh_readahead_ready())
+				tosh_flush();
+			if ((line = tosh_readahead_next(&words)) == NULL)
+				break;
+
+			// Record line in history.
+			tosh_record_line(line);
+		} else {
+			// Show the prompt (if we're talking to a tty).
+			TOSH_PHASE = TOSH_PHASE_PROMPT;
+			if (TOSH_INTERACTIVE)
+				tosh_prompt();
+
+			// Read in a line from stdin.
+			TOSH_PHASE = TOSH_PHASE_READ;
+			line = tosh_read_line();
+
+			// Record line in history.
+			tosh_record_line(line);
+
+			// Split line into words.
+			TOSH_PHASE = TOSH_PHASE_PARSE;
+			words = tosh_split_line(line);
+		}
+
+		// If this line was done in an earlier run of the script (see journal.c), skip it.
+		line_no++;
+		if (journal && words != NULL && tosh_journal_skippable(words) && tosh_journal_done(line_no, line)) {
+			DEBUG_LOG("skipping line %ld (done last time).", line_no)
+			tosh_free_words(words);
+			words = NULL;
+		}
 
-		// Read in a line from stdin.
-		line = tosh_read_line();
+		// (The report isn't the only one that wants to know how the line went.)
+		if (report || journal)
+			tosh_report_start();
 
-		// Record line in history.
-		tosh_record_line(line);
+		if (words != NULL) {
+			// If the command name was interned (and will be the same once expanded), hang on
+			// to the interned copy, so that finding out if it's a builtin is a pointer compare.
+			name = tosh_word_name(words);
 
-		// Split line into arguments.
-		args = tosh_split_line(line);
+			// Perform expansions on words, turning them into arguments.
+			TOSH_PHASE = TOSH_PHASE_EXPAND;
+			args = tosh_expand_args(words);
+			free(words);
+		} else {
+			args = NULL;
+		}
 
 		if (args != NULL) {
-			// Perform expansions on arguments.
-			args = tosh_expand_args(args);
+			// Is there anything left to do after this? (If we're keeping a journal or a report,
+			// there is: noting how this line went.)
+			TOSH_LAST_COMMAND = !loop || (!journal && !report && tosh_input_finished());
 
 			// Run command (builtin or not).
-			status = tosh_execute(args);
+			TOSH_PHASE = TOSH_PHASE_EXECUTE;
+			status = tosh_execute(args, name);
 			// Sync with environment variables.
 			tosh_sync_env_vars();
-
-			// Free memory used to store command line and arguments (on the heap).
-			free(line);
-			for (i = 0; args[i] != NULL; i++) {
-				free(args[i]);
-			}
+			// (Whatever we ran might have changed the terminal's settings.)
+			if (TOSH_STDIN_TTY)
+				tosh_tty_check();
+
+			// Note that it's done (if it was anything, and it worked; a line that failed
+			// is to be run again next time).
+			if (journal && args[0] != NULL && tosh_report_status() == 0)
+				tosh_journal_record(line_no, line);
+			if (report && args[0] != NULL)
+				tosh_report_end(line_no, line);
+
+			// Free memory used to store arguments (all in one block on the heap).
 			free(args);
 		}
+		free(line);
+
+		// Let the reader thread know (in case it's waiting for this line to finish).
+		if (loop && TOSH_BATCH)
+			tosh_readahead_done();
 
 	} while (status && loop); // Once tosh_execute returns zero, the shell terminates.
 				  // We also terminate if loop is false.
 }
 
+/* Write out whatever the shell has buffered up for stdout (and the history file). Called before
+ * anything else might write to them (a program we run, a subshell, or the user typing at the
+ * prompt), so that everything comes out in the right order, and only once. */
+void tosh_flush(void) {
+	if (fpending(stdout) > 0) {
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		fflush(stdout);
+	}
+	if (TOSH_HIST_FILE != NULL && fpending(TOSH_HIST_FILE) > 0) {
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		fflush(TOSH_HIST_FILE);
+	}
+}
+
+/* Write a diagnostic to stderr (as fprintf() would). Since stderr isn't buffered, whatever we've
+ * buffered up for stdout is written out first, so that it comes out in the order it was printed. */
+void tosh_error(char *format, ...) {
+	va_list ap;
+
+	tosh_flush();
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+/* Say what went wrong with the last call that failed (as perror() would), in order (see above). */
+void tosh_perror(void) {
+	int err = errno;
+
+	tosh_flush();
+	errno = err;
+	perror("tosh");
+}
+
+/* Check whether there are no more lines to come (without waiting for any more input).
+ * Returns 1 if we've definitely reached the end, and 0 if there's more (or we can't tell yet). */
+int tosh_input_finished(void) {
+	struct stat st;
+	int c;
+
+	if (TOSH_BATCH)
+		return tosh_readahead_finished();
+
+	// Only peek at regular files; anything else might keep us waiting.
+	if (fstat(fileno(stdin), &st) == -1 || !S_ISREG(st.st_mode))
+		return 0;
+	if ((c = getc(stdin)) == EOF)
+		return 1;
+	ungetc(c, stdin);
+	return 0;
+}
+
 // Buffer increment for read_line function.
 #define READ_BUF_INC 1024
 
@@ -242,6 +406,7 @@ char *tosh_read_line(void) {
 	// If the first character is already EOF...
 	if ((c = getchar_unbuf()) == EOF) {
 		DEBUG_LOG("first char was EOF.", NULL)
+		tosh_journal_finish();
 		exit(EXIT_SUCCESS);
 	}
 	ungetc(c, stdin);
@@ -276,145 +441,382 @@ char *tosh_read_line(void) {
 // Buffer increments for splitting lines.
 #define ARG_BUF_INC 128
 #define LINE_BUF_INC 64
-
-/* Convert a given line (string) into a list of (string) arguments. */
-char **tosh_split_line(char *line) {
-	int bl, q, i, j, c, argbufsize, linebufsize, num_args;
-	char **tokens, **tp;
-
-	argbufsize = ARG_BUF_INC;
+#define SPAN_BUF_INC 4
+
+// Characters which mean something in a pattern to be matched against filenames, or to have its
+// braces expanded (so must be escaped there, wherever they are to be taken literally).
+#define TOSH_PATTERN_CHARS "*?[]{},\\"
+
+// Forward declarations for tosh_split_line().
+void tosh_word_start(struct tosh_word *);
+void tosh_word_putc(struct tosh_word *, int *, int *, char);
+void tosh_word_open_span(struct tosh_word *, int *, int, int);
+void tosh_word_literal(struct tosh_word *, int *, int);
+void tosh_word_intern(struct tosh_word *, int);
+
+/* Convert a given line (string) into a list of words, terminated by one with a null string.
+ * Expressions to be substituted are located here (while we know how deeply nested in brackets
+ * we are), and their text is kept exactly as typed, ready to be handed to a subshell.
+ * Returns a null pointer if there is nothing to do (or the line doesn't make sense). */
+struct tosh_word *tosh_split_line(char *line) {
+	int bl, q, sub, sq, name, i, j, k, c, argbufsize, linebufsize, num_args, spanbufsize;
+	struct tosh_word *words, *wp;
+	struct tosh_span *sp;
+
+	argbufsize = TOSH_WORD_INLINE_LEN;
 	linebufsize = LINE_BUF_INC;
+	spanbufsize = 0;
 	i = j = 0;
 	q = 0;
 	bl = 0;
+	sub = sq = 0; // (depth of, and quoting inside, the substitution we're in -- if any)
+	name = 0; // (whether we're in a `$name` expression)
 	num_args = 0;
-	tokens = malloc(linebufsize * sizeof(char *));
-	tp = tokens;
-
-	*tp = malloc(argbufsize * sizeof(char));
-
-	if (!tokens || !tp) {
+	words = malloc(linebufsize * sizeof(struct tosh_word));
+	if (!words) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
+	wp = words;
+	tosh_word_start(wp);
 
 	while (bl >= 0) {
 		c = line[i++];
+
+		// Inside a substitution, copy everything as-is (the subshell will parse it),
+		// just keeping track of where it ends.
+		if (sub > 0 && c != EOF && c != '\n' && c != '\0') {
+			tosh_word_putc(wp, &j, &argbufsize, c);
+			if (sq) {
+				if (c == '\'')
+					sq = 0;
+			} else if (c == '\'') {
+				sq = 1;
+			} else if (c == '\\' && line[i] != '\0') {
+				tosh_word_putc(wp, &j, &argbufsize, line[i++]);
+			} else if (c == '(') {
+				sub++;
+			} else if (c == ')' && --sub == 0) {
+				// End of the substitution.
+				sp = &wp->spans[wp->num_spans - 1];
+				sp->ei = j - 1;
+				sp->rei = j;
+			}
+			continue;
+		}
+
+		// A `$name` expression runs up until the next thing to be substituted (or the end of the word).
+		if (name && (c == '$' || c == EOF || c == '\n' || c == '\0' || c == TOSH_COMMENT_CHAR
+					|| (c == ' ' && bl == 0 && q == 0))) {
+			sp = &wp->spans[wp->num_spans - 1];
+			sp->ei = sp->rei = j;
+			if (sp->ei == sp->si)
+				// Nothing after the dollar sign; leave it be.
+				wp->num_spans--;
+			name = 0;
+		}
+
 		switch (c) {
+			case '$':
+				if (!q && line[i] == '(') {
+					// Start of a substitution.
+					tosh_word_open_span(wp, &spanbufsize, j, j + 2);
+					tosh_word_putc(wp, &j, &argbufsize, '$');
+					tosh_word_putc(wp, &j, &argbufsize, line[i++]);
+					sub = 1;
+					sq = 0;
+				} else {
+					if (!q) {
+						tosh_word_open_span(wp, &spanbufsize, j, j + 1);
+						name = 1;
+					}
+					tosh_word_putc(wp, &j, &argbufsize, c);
+				}
+				break;
+			case '~':
+				// (Inside a `$name` expression, it's just part of the name.)
+				if (!q && !name) {
+					tosh_word_open_span(wp, &spanbufsize, j, j);
+					sp = &wp->spans[wp->num_spans - 1];
+					sp->ei = sp->rei = j + 1;
+					sp->kind = TOSH_SPAN_TILDE;
+				}
+				tosh_word_putc(wp, &j, &argbufsize, c);
+				break;
+			case '*':
+			case '?':
+			case '[':
+				if (!q)
+					wp->glob = 1;
+				else if (!name)
+					tosh_word_literal(wp, &spanbufsize, j);
+				tosh_word_putc(wp, &j, &argbufsize, c);
+				break;
+			case ']':
+			case '}':
+			case ',':
+				if (q && !name)
+					tosh_word_literal(wp, &spanbufsize, j);
+				tosh_word_putc(wp, &j, &argbufsize, c);
+				break;
+			case '{':
+				if (!q)
+					wp->brace = 1;
+				else if (!name)
+					tosh_word_literal(wp, &spanbufsize, j);
+				tosh_word_putc(wp, &j, &argbufsize, c);
+				break;
 			case '(':
 				if (!q)
 					bl++;
-				(*tp)[j++] = c;
+				tosh_word_putc(wp, &j, &argbufsize, c);
 				break;
 			case ')':
 				if (!q)
 					bl--;
-				(*tp)[j++] = c;
+				tosh_word_putc(wp, &j, &argbufsize, c);
 				break;
 			case '\'':
 				q = (q) ? 0 : 1;
 				break;
 			case '\\':
 				if (line[i] == '\'') {
-					(*tp)[j++] = '\'';
+					tosh_word_putc(wp, &j, &argbufsize, '\'');
 					i++;
-				} else if (line[i] == '\\') {
-					(*tp)[j++] = '\\';
+				} else if (line[i] != '\0' && strchr("\\$~*?[]{},", line[i]) != NULL) {
+					// (An escaped `$`, `~`, wildcard or brace is taken literally, since it gets no
+					// span and doesn't make the word one to glob; should the word be globbed or have
+					// its braces expanded anyway, a wildcard or brace is marked to be escaped there.)
+					if (!name && strchr(TOSH_PATTERN_CHARS, line[i]) != NULL)
+						tosh_word_literal(wp, &spanbufsize, j);
+					tosh_word_putc(wp, &j, &argbufsize, line[i]);
 					i++;
-				} 
+				}
 				break;
 			case ' ':
 				if (bl == 0 && q == 0) {
+					// Skip runs of spaces.
+					if (j == 0)
+						break;
+					wp->str[j] = '\0';
+					wp->len = j;
+					tosh_word_intern(wp, num_args == 0);
+					num_args++;
 					// Allocate more memory for line if needed.
-					while (num_args * sizeof(char *) >= linebufsize) {
+					if (num_args + 1 >= linebufsize) {
 						linebufsize += LINE_BUF_INC;
-						DEBUG_LOG("realloc'ing whilst parsing line (%d more bytes)...", LINE_BUF_INC)
-						tokens = realloc(tokens, linebufsize * sizeof(char *));
-						if (!tokens) {
+						DEBUG_LOG("realloc'ing whilst parsing line (%d more words)...", LINE_BUF_INC)
+						words = realloc(words, linebufsize * sizeof(struct tosh_word));
+						if (!words) {
 							fprintf(stderr, "tosh: memory allocation failed. :(\n");
 							exit(EXIT_FAILURE);
 						}
+						// (Words kept inline have moved along with the list.)
+						for (k = 0; k < num_args; k++) {
+							if (words[k].storage == TOSH_WORD_INLINE)
+								words[k].str = words[k].buf;
+						}
 					}
-					// Point to next token.
-					argbufsize = ARG_BUF_INC;
-					tp++;
-					*tp = malloc(argbufsize * sizeof(char));
-					if (!*tp) {
-						fprintf(stderr, "tosh: memory allocation failed. :(\n");
-						exit(EXIT_FAILURE);
-					}
+					// Point to next word.
+					argbufsize = TOSH_WORD_INLINE_LEN;
+					spanbufsize = 0;
+					wp = &words[num_args];
+					tosh_word_start(wp);
 					j = 0;
-					num_args++;
 				} else {
-					(*tp)[j++] = c;	
+					tosh_word_putc(wp, &j, &argbufsize, c);
 				}
 				break;
 			case EOF:
 			case '\n':
 			case '\0':
 			case TOSH_COMMENT_CHAR:
-				if (bl != 0) {
-					fprintf(stderr, "tosh: mismatched brackets. :(\n");
+				wp->str[j] = '\0';
+				words[num_args + 1].str = NULL;
+				if (bl != 0 || sub != 0) {
+					tosh_error("tosh: mismatched brackets. :(\n");
+					tosh_free_words(words);
 					return NULL;
 				} else if (q != 0) {
-					fprintf(stderr, "tosh: mismatched quotes. :(\n");
+					tosh_error("tosh: mismatched quotes. :(\n");
+					tosh_free_words(words);
 					return NULL;
 				}
-				if (num_args == 0 && strlen(*tp) == 0) {
+				if (j > 0) {
+					wp->len = j;
+					tosh_word_intern(wp, num_args == 0);
+					num_args++;
+				} else {
+					if (wp->storage == TOSH_WORD_HEAP)
+						free(wp->str);
+					wp->str = NULL;
+				}
+				if (num_args == 0) {
 					DEBUG_LOG("no arguments.", NULL)
+					free(words);
 					return NULL;
 				}
-				tp++;
-				tp = NULL;
-				return tokens;
+				return words;
 			default:
-				// Allocate more memory for argument if needed.
-				while (j * sizeof(char) >= argbufsize) {
-					argbufsize += ARG_BUF_INC;
-					DEBUG_LOG("realloc'ing whilst parsing argument (%d more bytes)...", ARG_BUF_INC)
-					tp = realloc(tp, argbufsize * sizeof(char));
-					if (!tp) {
-						fprintf(stderr, "tosh: memory allocation failed. :(\n");
-						exit(EXIT_FAILURE);
-					}
-				}
-				(*tp)[j++] = c;
+				tosh_word_putc(wp, &j, &argbufsize, c);
 				break;
 		}
 	}
 
-	fprintf(stderr, "tosh: mismatched brackets. :(\n");
+	tosh_error("tosh: mismatched brackets. :(\n");
+	wp->str[j] = '\0';
+	words[num_args + 1].str = NULL;
+	tosh_free_words(words);
 	return NULL;
 }
 
+/* Start off an (empty) word, kept inside itself until it gets too long. */
+void tosh_word_start(struct tosh_word *wp) {
+	wp->str = wp->buf;
+	wp->len = 0;
+	wp->storage = TOSH_WORD_INLINE;
+	wp->spans = NULL;
+	wp->num_spans = 0;
+	wp->glob = 0;
+	wp->brace = 0;
+}
+
+/* Append a character to the word being built by tosh_split_line() (at index *j). */
+void tosh_word_putc(struct tosh_word *wp, int *j, int *argbufsize, char c) {
+	// Allocate more memory for word if needed (leaving room for the null byte).
+	if (*j + 1 >= *argbufsize) {
+		*argbufsize += ARG_BUF_INC;
+		DEBUG_LOG("realloc'ing whilst parsing argument (%d more bytes)...", ARG_BUF_INC)
+		if (wp->storage == TOSH_WORD_INLINE) {
+			// Move out of the word's own buffer, onto the heap.
+			if ((wp->str = malloc(*argbufsize * sizeof(char))) != NULL)
+				memcpy(wp->str, wp->buf, *j);
+			wp->storage = TOSH_WORD_HEAP;
+		} else {
+			wp->str = realloc(wp->str, *argbufsize * sizeof(char));
+		}
+		if (!wp->str) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	wp->str[(*j)++] = c;
+}
+
+/* Record the start of an expression to be substituted in the word being built by tosh_split_line(). */
+void tosh_word_open_span(struct tosh_word *wp, int *spanbufsize, int rsi, int si) {
+	if (wp->num_spans >= *spanbufsize) {
+		*spanbufsize += SPAN_BUF_INC;
+		wp->spans = realloc(wp->spans, *spanbufsize * sizeof(struct tosh_span));
+		if (!wp->spans) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	wp->spans[wp->num_spans].rsi = rsi;
+	wp->spans[wp->num_spans].si = si;
+	wp->spans[wp->num_spans].kind = TOSH_SPAN_SUBST;
+	wp->num_spans++;
+}
+
+/* Record a character (at index j) of the word being built by tosh_split_line() that was quoted
+ * or escaped, so that it isn't taken as a wildcard (or brace) should the word be matched against
+ * filenames (or have its braces expanded). */
+void tosh_word_literal(struct tosh_word *wp, int *spanbufsize, int j) {
+	struct tosh_span *sp;
+
+	tosh_word_open_span(wp, spanbufsize, j, j);
+	sp = &wp->spans[wp->num_spans - 1];
+	sp->ei = sp->rei = j + 1;
+	sp->kind = TOSH_SPAN_LITERAL;
+}
+
+// Longest word worth interning (anything longer is unlikely to be a command name or option).
+#define TOSH_INTERN_MAX_LEN 64
+
+/* Swap a finished word for its interned copy, if it's the sort of word that scripts
+ * repeat a lot (a command name, or an option) and has nothing to be substituted in it. */
+void tosh_word_intern(struct tosh_word *wp, int first) {
+	char *str;
+
+	if (wp->num_spans > 0 || wp->len > TOSH_INTERN_MAX_LEN || !(first || wp->str[0] == '-'))
+		return;
+	if ((str = tosh_intern(wp->str, wp->len)) != NULL) {
+		if (wp->storage == TOSH_WORD_HEAP)
+			free(wp->str);
+		wp->str = str;
+		wp->storage = TOSH_WORD_INTERNED;
+	}
+}
+
+/* Get the interned copy of the command name (the first word) of a line, if it was interned and
+ * will expand to just itself (no globbing or braces). Returns a null pointer if not. */
+char *tosh_word_name(struct tosh_word *words) {
+	if (words[0].str == NULL || words[0].storage != TOSH_WORD_INTERNED || words[0].glob || words[0].brace)
+		return NULL;
+	return words[0].str;
+}
+
+/* Free a list of words returned by tosh_split_line(). */
+void tosh_free_words(struct tosh_word *words) {
+	struct tosh_word *wp;
+
+	for (wp = words; wp->str != NULL; wp++) {
+		if (wp->storage == TOSH_WORD_HEAP)
+			free(wp->str);
+		free(wp->spans);
+	}
+	free(words);
+}
+
 /* Fork and exec a requested external program */
 int tosh_launch(char **args) {
+	struct rusage usage;
 	pid_t id, wpid;
-	int status;
+	int status, err;
 
-	// Attempt to fork.
-	id = fork();
-	if (id == 0) {
-		// In the child process... exec, passing in argument vector.
-		// (also, use the PATH environment variable to find specified program.)
-		// This child process inherits stdin and stdout file descriptors, and so
-		// can still talk to whoever/whatever the original shell was connected to.
-		if (execvp(args[0], args) == -1) {
-			perror("tosh");
-		}
-		// (if we reach this point, the exec() call failed.)
+	// Don't bother trying if there are too many arguments to pass to the program at once.
+	if (!tosh_args_fit(args)) {
+		tosh_error("tosh: too many arguments for %s (try `batch %s ...`). :(\n", args[0], args[0]);
+		return 1;
+	}
+
+	// If this is the last thing we'll ever do, just become the program (rather than forking
+	// and waiting for it). In verbose mode we stick around, to report how it went.
+	if (TOSH_LAST_COMMAND && strcmp(TOSH_VERBOSE, "ON") != 0) {
+		DEBUG_LOG("last command; exec'ing %s in place.", args[0])
+		tosh_flush();
+		TOSH_COUNT(TOSH_SYS_EXEC);
+		execvp(args[0], args);
+		tosh_perror();
 		exit(EXIT_FAILURE);
-	} else if (id < 0) {
-		// Failed to fork.
-		perror("tosh");
+	}
+
+	// Start the program, passing in the argument vector (as it is, in one block).
+	// (also, use the PATH environment variable to find specified program.)
+	// The child process inherits stdin and stdout file descriptors, and so
+	// can still talk to whoever/whatever the original shell was connected to.
+	// (posix_spawnp() can avoid copying our page tables, as fork() would, just to exec.)
+	tosh_flush();
+	TOSH_COUNT(TOSH_SYS_FORK);
+	TOSH_COUNT(TOSH_SYS_EXEC);
+	if ((err = posix_spawnp(&id, args[0], NULL, NULL, args, environ)) != 0) {
+		// Failed to start (e.g. no such program).
+		tosh_error("tosh: %s\n", strerror(err));
+		tosh_report_fail(127);
 	} else {
 		// In the parent proces... wait for child.
 		if (strcmp(TOSH_VERBOSE, "ON") == 0) {
 			printf("[launching %s with pid %d]\n", args[0], id);
+			tosh_flush();
 		}
+		// (wait4() rather than waitpid(), so that it can go in the report, if there is one.)
 		do {
-			wpid = waitpid(id, &status, WUNTRACED);
+			TOSH_COUNT(TOSH_SYS_WAIT);
+			wpid = wait4(id, &status, WUNTRACED, &usage);
 		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+		if (wpid == id)
+			tosh_report_child(&usage, &status);
 
 		if (strcmp(TOSH_VERBOSE, "ON") == 0) {
 			printf("[%s terminated with exit code %d]\n", args[0], status / 256);
@@ -424,21 +826,24 @@ int tosh_launch(char **args) {
 	return 1;
 }
 
-/* Execute a command line (and either call an external program or a builtin).*/
-int tosh_execute(char **args) {
+/* Execute a command line (and either call an external program or a builtin). name is the
+ * interned copy of args[0], from tosh_word_name(), or a null pointer if there isn't one. */
+int tosh_execute(char **args, char *name) {
 	int i;
 
 	if (args[0] == NULL) {
 		// Didn't type anything in...
-		if (strcmp(TOSH_VERBOSE, "ON") == 0 && isatty(fileno(stdin))) {
+		if (strcmp(TOSH_VERBOSE, "ON") == 0 && TOSH_STDIN_TTY) {
 			printf("\n...what do you want to do?\n");
 		}
 		return 1;
 	}
 
-	// Check if it's a builtin.
+	// Check if it's a builtin. (Builtin names are interned, so if we have the interned name,
+	// we need only compare pointers; otherwise, e.g. if it came out of a substitution, compare
+	// the strings.)
 	for (i = 0; i < tosh_num_builtins(); i++) {
-		if (strcmp(args[0], builtin_str[i]) == 0) {
+		if (name != NULL ? name == builtin_str[i] : strcmp(args[0], builtin_str[i]) == 0) {
 			// Run the builtin, and return.
 			if (strcmp(TOSH_VERBOSE, "ON") == 0) {
 				printf("[launching builtin %s]\n", args[0]);
@@ -451,6 +856,24 @@ int tosh_execute(char **args) {
 	return tosh_launch(args);
 }
 
+/* Check whether a line may be skipped when picking a script up from its journal: anything but
+ * a builtin (apart from batch), since those are cheap, and set things up (e.g. with `cd`) for
+ * the lines after them. */
+int tosh_journal_skippable(struct tosh_word *words) {
+	char *name;
+	int i;
+
+	if (words[0].str == NULL)
+		return 0;
+	// (Builtin names are interned, so a word that wasn't can't be one.)
+	if ((name = tosh_word_name(words)) == NULL)
+		return 1;
+	for (i = 0; i < tosh_num_builtins(); i++)
+		if (name == builtin_str[i])
+			return strcmp(name, "batch") == 0;
+	return 1;
+}
+
 // Forward declarations for tosh_prompt()
 void tosh_show_path(char *, int, int);
 
@@ -475,6 +898,7 @@ void tosh_prompt(void) {
 			switch (TOSH_PROMPT[++i]) {
 				case 'p':
 					// CURRENT WORKING DIRECTORY (FOR NOW, THE ABSOLUTE PATH)
+					TOSH_COUNT(TOSH_SYS_GETCWD);
 					while (getcwd(buf, bufsize) == NULL) {
 						// Buffer overflow; reallocate.
 						bufsize += PROMPT_BUF_INC;
@@ -501,7 +925,7 @@ void tosh_prompt(void) {
 					if ((username = getenv("USER")) != NULL) {
 						printf(RED "%s" RESET, username);
 					} else {
-						fprintf(stderr, "tosh: I couldn't find your username. :(\n");
+						tosh_error("tosh: I couldn't find your username. :(\n");
 					}
 					break;
 				case 'h':
@@ -524,141 +948,167 @@ void tosh_prompt(void) {
 		}
 	}
 	free(buf);
-	fflush(stdout);
+	tosh_flush();
 }
 
-/* Expand the given string (could be a command argument, or else) according to tosh's expansion rules.
- * NOTE: takes a char pointer that is assumed to have been malloc'd earlier; requires freeing later.
- *       this function is recursive; possibly not particularly efficient. */
-char *tosh_expand_tilde(char *str) {
-	char *homedir, *tildeloc, *remstr;
+// Forward declarations for tosh_expand_args.
+char **tosh_glob_string(char *);
+void tosh_glob_free(void);
+struct tosh_view tosh_expand_word(struct tosh_word *, int *, int *);
 
-	if ((homedir = getenv("HOME")) == NULL) {
-		fprintf(stderr, "tosh: I couldn't find your home directory. :(\n");
-		return str;
-	}
+#define TOSH_EXPAND_BUF_INC 64
+#define ARGV_STR_BUF_INC 1024
+
+/* An argument vector under construction: the strings packed one after another in a single
+ * buffer (recorded by offset, since the buffer moves as it grows). */
+struct tosh_argv {
+	char *strs;
+	int len, size;
+	int *offsets;
+	int num, max;
+	int glob, escaped;
+};
 
-	str = realloc(str, (strlen(str) - 1 + strlen(homedir) + 1) * sizeof(char));
-	if (!str) {
+void tosh_argv_init(struct tosh_argv *av) {
+	av->len = av->num = 0;
+	av->size = ARGV_STR_BUF_INC;
+	av->max = TOSH_EXPAND_BUF_INC;
+	av->strs = malloc(av->size * sizeof(char));
+	av->offsets = malloc(av->max * sizeof(int));
+	if (!av->strs || !av->offsets) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
+}
 
-	// If there isn't a tilde...
-	if ((tildeloc = strchr(str, '~')) == NULL) {
-		return str;
+/* Add (a copy of) a string to the end of an argument vector. If escaped, it is a pattern (see
+ * tosh_expand_word()) that matched nothing, or had no wildcards, so is copied without its
+ * escaping backslashes. */
+void tosh_argv_add(struct tosh_argv *av, struct tosh_view v, int escaped) {
+	int i, len = v.len + 1;
+	char *p;
+
+	// Increase buffer sizes if necessary (doubling, since a glob can add a lot at once).
+	if (av->len + len > av->size) {
+		av->size = 2 * (av->len + len);
+		av->strs = realloc(av->strs, av->size * sizeof(char));
 	}
-
-	// Copy remainder of string.
-	remstr = malloc((strlen(tildeloc) + 1) * sizeof(char));
-	if (!remstr) {
+	if (av->num >= av->max) {
+		av->max *= 2;
+		av->offsets = realloc(av->offsets, av->max * sizeof(int));
+	}
+	if (!av->strs || !av->offsets) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
-	strcpy(remstr, tildeloc + 1);
-	// Copy value of HOME from tilde onwards.
-	strcpy(tildeloc, homedir);
-	// Copy rest of string after HOME.
-	strcpy(tildeloc + strlen(homedir), remstr);
-	free(remstr);
-	
-	return tosh_expand_tilde(str);
-}
-
-/* Expand instances of `!!` in the given string.
- * NOTE: takes a char pointer that is assumed to have been malloc'd earlier; requires freeing later. */
-char *tosh_expand_bang(char *str) {
-	int si, ei;
 
-	// Find a bang.
-	for (si = 0; str[i] != '\0' && str[i] != '!'; i++)
-		;
-
-	if (str[i] != '\0' && str[i+1] == '!') {
-		ei = i + 1;
+	p = &av->strs[av->len];
+	if (!escaped) {
+		memcpy(p, v.str, v.len);
+		p += v.len;
 	} else {
-		return str;
+		for (i = 0; i < v.len; i++) {
+			if (v.str[i] == '\\' && i + 1 < v.len)
+				i++;
+			*p++ = v.str[i];
+		}
 	}
-
-	// (assuming TOSH_LAST_LINE is a string that contains the last executed command line)
-	tosh_str_substitute(str, 
+	*p++ = '\0';
+	av->offsets[av->num++] = av->len;
+	av->len = p - av->strs;
 }
 
-// Forward declarations for tosh_expand_args.
-char **tosh_glob_string(char *);
-void tosh_glob_free(void);
-char *tosh_expand_expression(char *);
-
-#define TOSH_EXPAND_BUF_INC 64
+/* Add a string (from a word with the given av->glob and av->escaped bits) to the end of an argument
+ * vector, replacing it with the filenames it matches if it is a glob pattern. */
+void tosh_argv_add_globbed(struct tosh_view str, void *data) {
+	struct tosh_argv *av = data;
+	char **globbed;
+	int j;
+
+	// Perform globbing using metacharacters.
+	if (!av->glob || (globbed = tosh_glob_string(str.str)) == NULL) {
+		// If nothing matched, leave it as it was. (this behaviour is perhaps debatable?)
+		DEBUG_LOG("nothing matched.", NULL)
+		tosh_argv_add(av, str, av->escaped);
+	} else {
+		// If matched, add in matches as new args.
+		for (j = 0; globbed[j] != NULL; j++) {
+			DEBUG_LOG("found %s.", globbed[j])
+			tosh_argv_add(av, tosh_view(globbed[j]), 0);
+		}
 
-/* Perform expansion on each of the arguments in the argument vector. */
-char **tosh_expand_args(char **args) {
-	int i, j, k = 0;
-	int bufsize = TOSH_EXPAND_BUF_INC;
-	char **globbed, **newargs, *matchedstr, *newarg;
+		// Free glob structure (now that we've copied the matches).
+		tosh_glob_free();
+	}
+}
 
-	newargs = malloc(bufsize * sizeof(char *));
-	// Iterate through args, replacing them with their expansions.
-	for (i = 0; args[i] != NULL; i++) {
-		DEBUG_LOG("expanding arg: %s...", args[i]);
+/* Turn an argument vector into a single block (the null-terminated list of pointers, followed
+ * by the strings they point to), which can be handed straight to exec and freed in one go. */
+char **tosh_argv_finish(struct tosh_argv *av) {
+	char **args, *strs;
+	int i;
 
-		// Expand tilde.
-		args[i] = tosh_expand_tilde(args[i]);
-		DEBUG_LOG("tilde expanded into %s.", args[i]);
+	args = malloc((av->num + 1) * sizeof(char *) + av->len * sizeof(char));
+	if (!args) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	strs = (char *) &args[av->num + 1];
+	memcpy(strs, av->strs, av->len * sizeof(char));
+	for (i = 0; i < av->num; i++)
+		args[i] = &strs[av->offsets[i]];
+	args[av->num] = NULL;
+
+	free(av->strs);
+	free(av->offsets);
+	return args;
+}
 
-		// Expand any $(EXPRESSION)s (expand until none left -- slightly inefficient but fine for our purposes).
-		if ((newarg = tosh_expand_expression(args[i])) != NULL) {
-			args[i] = newarg;
-		} else {
-			DEBUG_LOG("no expression to expand.", NULL)
-		}
-		DEBUG_LOG("further expanded into %s.", args[i]);
-
-		// Perform globbing using metacharacters.
-		if ((globbed = tosh_glob_string(args[i])) == NULL) {
-			// If nothing matched, leave it as it was. (this behaviour is perhaps debatable?)
-			DEBUG_LOG("nothing matched.", NULL)
-			newargs[k++] = args[i];
-
-			// Increase buffer size (total number of arguments) if necessary.
-			if (k >= bufsize) {
-				bufsize += TOSH_EXPAND_BUF_INC;
-				newargs = realloc(newargs, bufsize * sizeof(char));
-				if (!newargs) {
-					fprintf(stderr, "tosh: memory allocation failed. :(\n");
-					exit(EXIT_FAILURE);
-				}
+/* Perform expansion on each of the words in the list, turning them into an argument vector
+ * (a single block, as from tosh_argv_finish(), so free it with just free()).
+ * The words' strings are used up in the process. Returns a null pointer if expansion failed. */
+char **tosh_expand_args(struct tosh_word *words) {
+	int i, brace, failed = 0;
+	struct tosh_view newarg;
+	struct tosh_argv av;
+
+	tosh_argv_init(&av);
+
+	// Iterate through words, replacing them with their expansions.
+	for (i = 0; words[i].str != NULL; i++) {
+		DEBUG_LOG("expanding arg: %s...", words[i].str);
+
+		// Expand tildes and any $(EXPRESSION)s (all in one pass), finding out whether it's worth
+		// globbing (if it has metacharacters outside of quotes; the output of a substitution
+		// counts as unquoted). Otherwise, don't bother searching the filesystem.
+		newarg = tosh_expand_word(&words[i], &av.escaped, &av.glob);
+		brace = words[i].brace;
+		if (words[i].storage == TOSH_WORD_HEAP)
+			free(words[i].str);
+		free(words[i].spans);
+		DEBUG_LOG("expanded into %s.", newarg.str);
+
+		if (failed) {
+			// (Just clear up the rest of the words.)
+		} else if (brace) {
+			// Expand braces, globbing each of the words they make (if need be) as we go.
+			// Stop if they'd make more than we could ever pass to a program.
+			if (!tosh_brace_expand(newarg, tosh_arg_max(), tosh_argv_add_globbed, &av)) {
+				tosh_error("tosh: that brace expansion makes too many arguments. :(\n");
+				failed = 1;
 			}
 		} else {
-			// If matched, add in matches as new args.
-			for (j = 0; (matchedstr = globbed[j]) != NULL; j++) {
-				// Copy globbed filename (this will be deallocated in tosh_loop()).
-				DEBUG_LOG("found %s.", matchedstr)
-				newargs[k] = malloc((strlen(matchedstr) + 1) * sizeof(char));
-				if (!newargs[k]) {
-					fprintf(stderr, "tosh: memory allocation failed. :(\n");
-					exit(EXIT_FAILURE);
-				}
-				strcpy(newargs[k++], matchedstr);
-
-				// Increase buffer size (total number of arguments) if necessary.
-				if (k >= bufsize) {
-					bufsize += TOSH_EXPAND_BUF_INC;
-					newargs = realloc(newargs, bufsize * sizeof(char));
-					if (!newargs) {
-						fprintf(stderr, "tosh: memory allocation failed. :(\n");
-						exit(EXIT_FAILURE);
-					}
-				}
-
-			}
+			tosh_argv_add_globbed(newarg, &av);
 		}
+		free(newarg.str);
 	}
-	// Free glob structure if we used it.
-	if (i > 0)
-		tosh_glob_free();
 
-	return newargs;
+	if (failed) {
+		free(av.strs);
+		free(av.offsets);
+		return NULL;
+	}
+	return tosh_argv_finish(&av);
 }
 
 void tosh_parse_args(int argc, char **argv) {
@@ -666,9 +1116,14 @@ void tosh_parse_args(int argc, char **argv) {
 	if (argc == 1) {
 		return;
 	}
+	TOSH_SELF = argv[0];
+
 	// Iterate over arguments.
 	for (i = 1; i < argc; i++) {
-		if (argv[i][0] == '-') {
+		if (strcmp(argv[i], "--worker") == 0) {
+			// Run commands for another tosh (see worker.c), rather than being a shell.
+			exit(tosh_worker_main());
+		} else if (argv[i][0] == '-') {
 			// Parse flags.
 			for (j = 1; argv[i][j] != '\0'; j++) {
 				switch (argv[i][j]) {
@@ -682,7 +1137,7 @@ void tosh_parse_args(int argc, char **argv) {
 						TOSH_FORCE_INTERACTIVE = "ON";
 						break;
 					default:
-						fprintf(stderr, "tosh: I don't know the option '%c'.\n", argv[i][j]);
+						tosh_error("tosh: I don't know the option '%c'.\n", argv[i][j]);
 						break;
 				}
 			}
@@ -724,237 +1179,411 @@ void tosh_show_path(char *path, int n, int rainbow) {
 
 /* Return a list of matched paths for a given string pattern. */
 char **tosh_glob_string(char *arg) {
-	char **paths, *buf, c;
+	// Match the pattern; return null pointer if nothing matched.
+	TOSH_GLOB_MATCHES = tosh_walk_glob(arg, strcmp(TOSH_GLOB_IGNORE, "ON") == 0, strcmp(TOSH_GLOB_LOCALE, "ON") == 0);
+	return TOSH_GLOB_MATCHES;
+}
 
-	// Create a glob_t structure to hold returned information from system.
-	static glob_t gstruct;
-	DEBUG_LOG("setting pointer to global glob struct...", NULL)
-	TOSH_GLOB_STRUCT_PTR = &gstruct;
+void tosh_glob_free(void) {
+	// Free the matches (all in one block).
+	DEBUG_LOG("freeing glob matches @0x%p...", TOSH_GLOB_MATCHES)
+	free(TOSH_GLOB_MATCHES);
+	TOSH_GLOB_MATCHES = NULL;
+}
 
-	// Glob pattern; return null pointer if nothing matched.
-	if (glob(arg, 0, NULL, &gstruct) == GLOB_NOMATCH) {
-		return NULL;
-	}
+// Forward declarations for tosh_expand_word().
+struct tosh_view tosh_eval_line(char *);
+
+/* A view of a whole (null-terminated) string. */
+struct tosh_view tosh_view(char *str) {
+	struct tosh_view v = { str, strlen(str) };
 
-	// Return vector of matches.
-	return gstruct.gl_pathv;
+	return v;
 }
 
-void tosh_glob_free(void) {
-	// Free the global glob struct.
-	DEBUG_LOG("freeing global glob struct @0x%p...", TOSH_GLOB_STRUCT_PTR)
-	globfree(TOSH_GLOB_STRUCT_PTR);
+/* A view of the part of a string from si up to (but not including) ei. */
+struct tosh_view tosh_view_slice(struct tosh_view v, int si, int ei) {
+	struct tosh_view slice = { &v.str[si], ei - si };
+
+	return slice;
 }
 
-// Forward declarations for tosh_expand_expression().
-int tosh_locate_expression(char *, int *, int *, int *, int *);
-char *tosh_eval_line(char *);
-char *tosh_str_substitute(char *, int, int, char *);
+/* A (dynamically allocated, null-terminated) copy of a string; requires freeing later. */
+char *tosh_view_dup(struct tosh_view v) {
+	char *str = malloc((v.len + 1) * sizeof(char));
 
-/* Expand the first expression to be substituted found in the string str.
- * Returns a null pointer if no expression to be evaluated was found. 
- * Returned string is dynamically allocated; requires freeing later. */
-char *tosh_expand_expression(char *str) {
-	int si, ei, rsi, rei;
-	char *expr, *result, *newstr;
+	if (!str) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(str, v.str, v.len);
+	str[v.len] = '\0';
+	return str;
+}
 
-	DEBUG_LOG("expanding expression in line '%s'...", str);
+/* A piece of a word under construction: a slice of some existing string, which
+ * we either borrow or own (e.g. the output of a subshell, freed once we're done). */
+struct tosh_seg {
+	struct tosh_view v;
+	int owned;
+};
 
-	// Locate expression.
-	if (!tosh_locate_expression(str, &si, &ei, &rsi, &rei)) {
-		// Not found.
-		DEBUG_LOG("didn't find an expression to be evaluated.", NULL)
-		return NULL;
-	} 
+/* A word built up out of segments, and only copied into place once at the end
+ * (so that a word with lots of things to expand still costs linear time). */
+struct tosh_rope {
+	struct tosh_seg *segs;
+	int num_segs;
+	int bufsize;
+	int len;
+};
 
-	// Evaluate expression in a subshell.
-	expr = malloc((strlen(&str[si]) + 1) * sizeof(char));
-	if (!expr) {
+#define ROPE_BUF_INC 16
+
+void tosh_rope_init(struct tosh_rope *rope) {
+	rope->bufsize = ROPE_BUF_INC;
+	rope->num_segs = 0;
+	rope->len = 0;
+	rope->segs = malloc(rope->bufsize * sizeof(struct tosh_seg));
+	if (!rope->segs) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
-	memcpy(expr, &str[si], strlen(str) - si);
-	expr[ei - si] = '\0';
-	DEBUG_LOG("evaluating: '%s'...", expr);
-	result = tosh_eval_line(expr);
-	free(expr);
-	DEBUG_LOG("evaluated to: '%s'", result);
-	
-	// Substitute back into str.
-	newstr = tosh_str_substitute(str, rsi, rei, result);
-	free(str);
-	free(result);
-	DEBUG_LOG("substitution yields: '%s'", newstr);
+}
 
-	return newstr;
+/* Append a string to the rope. If owned, it is freed by tosh_rope_join(). */
+void tosh_rope_add(struct tosh_rope *rope, struct tosh_view v, int owned) {
+	if (v.len == 0) {
+		if (owned)
+			free(v.str);
+		return;
+	}
+	// Allocate more segments if needed.
+	if (rope->num_segs >= rope->bufsize) {
+		rope->bufsize += ROPE_BUF_INC;
+		rope->segs = realloc(rope->segs, rope->bufsize * sizeof(struct tosh_seg));
+		if (!rope->segs) {
+			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	rope->segs[rope->num_segs].v = v;
+	rope->segs[rope->num_segs].owned = owned;
+	rope->num_segs++;
+	rope->len += v.len;
 }
 
-/* Find the first expression to be evaluated and substituted in the string str.
- * Returns the start and end indices of the expression as si and ei, and the
- * start and end indices of the whole substring to be replaced as rsi and rei.
- * Actual return value is 1 if an expression was found, and 0 if not. */
-int tosh_locate_expression(char *str, int *si, int *ei, int *rsi, int *rei) {
+/* A (dynamically allocated, null-terminated) copy of a string, with a backslash before each of
+ * the given characters in it; requires freeing later. */
+struct tosh_view tosh_view_escape(struct tosh_view v, char *chars) {
+	struct tosh_view escaped;
+	int i, n = 0;
+
+	for (i = 0; i < v.len; i++)
+		if (v.str[i] != '\0' && strchr(chars, v.str[i]) != NULL)
+			n++;
+	escaped.str = malloc((v.len + n + 1) * sizeof(char));
+	if (!escaped.str) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = n = 0; i < v.len; i++) {
+		if (v.str[i] != '\0' && strchr(chars, v.str[i]) != NULL)
+			escaped.str[n++] = '\\';
+		escaped.str[n++] = v.str[i];
+	}
+	escaped.str[n] = '\0';
+	escaped.len = n;
+	return escaped;
+}
+
+/* Check whether any of the given characters appear in a string. */
+int tosh_view_has(struct tosh_view v, char *chars) {
 	int i;
-	char *str2, *substr;
 
-	// Find a dollar sign...
-	for (i = 0; str[i] != '$' && str[i] != '\0'; i++)
-		;
-	// Didn't find one.
-	if (str[i] == '\0')
-		return 0;
+	for (i = 0; i < v.len; i++)
+		if (v.str[i] != '\0' && strchr(chars, v.str[i]) != NULL)
+			return 1;
+	return 0;
+}
 
-	// If dollar sign has been escaped...
-	if ((i > 0) && str[i - 1] == '\\') {
-		// TODO: fill this in.
-	}
+/* Append literal text to the rope, expanding any tildes in it into HOME (escaped, as for
+ * tosh_expand_word(), if need be). */
+void tosh_rope_add_literal(struct tosh_rope *rope, struct tosh_view v, int escaped) {
+	struct tosh_view home = { NULL, 0 };
+	int i, start = 0;
 
-	*si = i + 1;
-	*rsi = i;
+	for (i = 0; i < v.len; i++) {
+		if (v.str[i] == '~') {
+			if (home.str == NULL && (home.str = getenv("HOME")) == NULL) {
+				tosh_error("tosh: I couldn't find your home directory. :(\n");
+				break;
+			}
+			if (home.len == 0)
+				home.len = strlen(home.str);
+			tosh_rope_add(rope, tosh_view_slice(v, start, i), 0);
+			if (escaped)
+				tosh_rope_add(rope, tosh_view_escape(home, TOSH_PATTERN_CHARS), 1);
+			else
+				tosh_rope_add(rope, home, 0);
+			start = i + 1;
+		}
+	}
+	tosh_rope_add(rope, tosh_view_slice(v, start, v.len), 0);
+}
 
-	if (str[++i] == '(') {
-		// If next char is an opening bracket, look for a closing one.
-		(*si)++;
-		for (i = strlen(str) - 1; i >= 0 && str[i] != ')'; i--)
-			;
-		// Didn't find one.
-		if (i == 0)
-			return 0;
-		*ei = i;
-		*rei = i + 1;
+/* Copy all the segments of the rope into a single (dynamically allocated, null-terminated)
+ * string of exactly the right size, and release the rope. The returned string requires freeing later. */
+struct tosh_view tosh_rope_join(struct tosh_rope *rope) {
+	struct tosh_view joined;
+	char *p;
+	int i;
 
-	
-	} else {
-		// Otherwise, take rest of string up to whitespace or end (null byte).
-		for (; str[i] != ' ' && str[i] != '\t' && str[i] != '\n' && str[i] != '\0'; i++)
-			;
-		*ei = i;
-		*rei = i;
+	p = joined.str = malloc((rope->len + 1) * sizeof(char));
+	if (!joined.str) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < rope->num_segs; i++) {
+		memcpy(p, rope->segs[i].v.str, rope->segs[i].v.len);
+		p += rope->segs[i].v.len;
+		if (rope->segs[i].owned)
+			free(rope->segs[i].v.str);
 	}
+	*p = '\0';
+	joined.len = rope->len;
+	free(rope->segs);
 
-	return 1;
+	return joined;
 }
 
-/* Substitute substr for the substring of str delimited by the indices si and ei.
- * (start index and end index respectively: si included; ei not.)
- * Returns a dynamically allocated string; requires freeing later. */
-char *tosh_str_substitute(char *str, int si, int ei, char *substr) {
-	char *newstr = malloc((strlen(str) - (ei - si + 1) + strlen(substr) + 1) * sizeof(char));
-	if (!newstr) {
-		fprintf(stderr, "tosh: memory allocation failed. :(\n");
-		exit(EXIT_FAILURE);
+/* Expand tildes and every expression to be substituted in the given word, building the result
+ * up out of segments (literal text, and the outputs of subshells). The expressions are the
+ * spans recorded by tosh_split_line(), so each one is evaluated exactly once.
+ * If the word might be matched against filenames or have its braces expanded, the result is a
+ * pattern, in which everything to be taken literally (quoted or escaped wildcards and braces, HOME,
+ * and braces and backslashes from substitutions) is escaped; *escaped is set if so, and *glob if
+ * the result has any wildcards that aren't.
+ * The word is left untouched; the returned string is dynamically allocated, and requires freeing later. */
+struct tosh_view tosh_expand_word(struct tosh_word *word, int *escaped, int *glob) {
+	int i, pos = 0;
+	struct tosh_view str = { word->str, word->len }, result;
+	char *expr;
+	struct tosh_span *sp;
+	struct tosh_rope rope;
+
+	*glob = word->glob;
+	*escaped = 0;
+
+	// Nothing to substitute (e.g. it was all quoted); just copy it.
+	if (word->num_spans == 0) {
+		result.str = tosh_view_dup(str);
+		result.len = str.len;
+		return result;
 	}
 
-	DEBUG_LOG("substituting %s in the string %s...\n", substr, str);
-	DEBUG_LOG("start index: %d, end index: %d.\n", si, ei);
+	// Only a word with wildcards or braces of its own, or substitutions (which may turn out to have
+	// wildcards), needs to be a pattern.
+	*escaped = word->glob || word->brace;
+	for (i = 0; i < word->num_spans; i++)
+		if (word->spans[i].kind == TOSH_SPAN_SUBST)
+			*escaped = 1;
+
+	tosh_rope_init(&rope);
+
+	for (i = 0; i < word->num_spans; i++) {
+		sp = &word->spans[i];
+
+		// Literal text leading up to the expression.
+		tosh_rope_add(&rope, tosh_view_slice(str, pos, sp->rsi), 0);
+		pos = sp->rei;
+
+		if (sp->kind == TOSH_SPAN_TILDE) {
+			tosh_rope_add_literal(&rope, tosh_view_slice(str, sp->rsi, sp->rei), *escaped);
+			continue;
+		} else if (sp->kind == TOSH_SPAN_LITERAL) {
+			if (*escaped)
+				tosh_rope_add(&rope, tosh_view("\\"), 0);
+			tosh_rope_add(&rope, tosh_view_slice(str, sp->rsi, sp->rei), 0);
+			continue;
+		}
 
-	// Copy the original string (all of it).
-	strcpy(newstr, str);
-	DEBUG_LOG("newstr: %s\n", newstr);
-	// Insert substring
-	strcpy(&newstr[si], substr);
-	DEBUG_LOG("newstr: %s\n", newstr);
-	// Insert rest of string
-	strcpy(&newstr[si + strlen(substr)], &str[ei]);
-	DEBUG_LOG("newstr: %s\n", newstr);
+		// Evaluate expression in a subshell.
+		expr = tosh_view_dup(tosh_view_slice(str, sp->si, sp->ei));
+		DEBUG_LOG("evaluating: '%s'...", expr);
+		result = tosh_eval_line(expr);
+		free(expr);
+		DEBUG_LOG("evaluated to: '%s'", result.str);
+		if (tosh_view_has(result, "*?["))
+			*glob = 1;
+		if (*escaped && tosh_view_has(result, "{},\\")) {
+			expr = result.str;
+			result = tosh_view_escape(result, "{},\\");
+			free(expr);
+		}
+		tosh_rope_add(&rope, result, 1);
+	}
+	tosh_rope_add(&rope, tosh_view_slice(str, pos, str.len), 0);
 
-	return newstr;
+	return tosh_rope_join(&rope);
+}
+
+/* Expand every tilde in the given string into HOME.
+ * Returns a new (dynamically allocated) string; requires freeing later. */
+struct tosh_view tosh_expand_tilde(struct tosh_view str) {
+	struct tosh_rope rope;
+
+	tosh_rope_init(&rope);
+	tosh_rope_add_literal(&rope, str, 0);
+	return tosh_rope_join(&rope);
 }
 
 // Buffer increment for receiving the data returned by a subshell.
 #define RESULT_BUF_INC 2048
 
+// Forward declarations for tosh_eval_line().
+struct tosh_view tosh_eval_failed(void);
+
+#ifndef TOSH_FUZZ
 /* Spawn a subshell to execute a given command and return the outputted string,
  * ready for substitution (usually).
  * Returns a dynamically allocated string; requires freeing later.
  * For now, we strip the final newline in the result, but don't worry about others. */
-char *tosh_eval_line(char *line) {
+struct tosh_view tosh_eval_line(char *line) {
 	pid_t id;
 	int backpipe_fd[2];
 	int topipe_fd[2];
-	char *buf, c;
-	int bufsize = RESULT_BUF_INC, bytes_read;
-
+	int keep_fds[2 + 2 * TOSH_MAX_COPROCS] = { -1, -1 };
+	struct tosh_view result;
+	struct rusage usage;
+	char *buf;
+	int bufsize = RESULT_BUF_INC, bytes_read, len = 0;
 
 	// Create pipes to transfer data to and from the subshell.
 	// (x[0] is the read end; x[1] the write end.)
-	if (pipe(backpipe_fd) == -1) {
-		fprintf(stderr, "tosh: I couldn't make the backpipe. :(\n");
+	if (tosh_fd_pipe(backpipe_fd) == -1) {
+		tosh_perror();
+		tosh_error("tosh: I couldn't make the backpipe. :(\n");
+		return tosh_eval_failed();
 	}
-	if (pipe(topipe_fd) == -1) {
-		fprintf(stderr, "tosh: I couldn't make the topipe. :(\n");
+	if (tosh_fd_pipe(topipe_fd) == -1) {
+		tosh_perror();
+		tosh_error("tosh: I couldn't make the topipe. :(\n");
+		tosh_fd_close(backpipe_fd[0]);
+		tosh_fd_close(backpipe_fd[1]);
+		return tosh_eval_failed();
 	}
 
-	// Fork shell
+	// Fork shell (with nothing left in our output buffer for the child to write out again).
+	tosh_flush();
+	TOSH_COUNT(TOSH_SYS_FORK);
 	id = fork();
 	DEBUG_LOG("%d: forked.", id)
 
-	// Write command line to topipe's input.
-	write(topipe_fd[1], line, (strlen(line) + 1) * sizeof(char));
-	close(topipe_fd[1]);
-
-
 	if (id == 0) {
 		// [In the child...]
-		close(backpipe_fd[0]);
-
 		// Connect stdin to topipe's output; stdout to backpipe's input.
-		dup2(topipe_fd[0], fileno(stdin));
+		// (Throw away anything of the parent's that is still buffered on stdin,
+		// so that we only see the expression we've been given.)
+		fpurge(stdin);
 		dup2(fileno(stdout), fileno(stderr));
-		dup2(backpipe_fd[1], fileno(stdout)); 
+		tosh_fd_move(topipe_fd[0], fileno(stdin));
+		tosh_fd_move(backpipe_fd[1], fileno(stdout));
+
+		// Let go of everything else of the parent's (apart from the history file, and the
+		// pipes to any coprocesses, so that `$(coproc ask ...)` works).
+		if (TOSH_HIST_FILE != NULL)
+			keep_fds[0] = fileno(TOSH_HIST_FILE);
+		tosh_coproc_keep(keep_fds);
+		tosh_fd_close_others(keep_fds);
 
 		// Execute command line (non-looping).
 		TOSH_DEBUG = "OFF";
 		TOSH_VERBOSE = "OFF";
+		TOSH_BATCH = 0;
 		tosh_init();
 		tosh_loop(0);
 
 		// (We usually shouldn't end up here.)
-		close(topipe_fd[0]);
 		DEBUG_LOG("child: exiting...", NULL)
 		exit(EXIT_SUCCESS);
 
+	} else if (id < 0) {
+		// Failed to fork.
+		tosh_perror();
+		tosh_fd_close(backpipe_fd[0]);
+		tosh_fd_close(backpipe_fd[1]);
+		tosh_fd_close(topipe_fd[0]);
+		tosh_fd_close(topipe_fd[1]);
+		return tosh_eval_failed();
+
 	} else {
 		// [In the parent...]
-		close(backpipe_fd[1]);
-		close(topipe_fd[0]);
+		tosh_fd_close(backpipe_fd[1]);
+		tosh_fd_close(topipe_fd[0]);
+
+		// Write command line to topipe's input.
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		if (write(topipe_fd[1], line, (strlen(line) + 1) * sizeof(char)) == -1)
+			tosh_perror();
+		tosh_fd_close(topipe_fd[1]);
 
 		buf = malloc(bufsize * sizeof(char));
 		if (!buf) {
 			fprintf(stderr, "tosh: memory allocation failed. :(\n");
+			exit(EXIT_FAILURE);
 		}
 
+		// Read everything from the pipe until the child is done with it (before waiting for the
+		// child, since it can't finish while the pipe is full).
+		while (TOSH_COUNT(TOSH_SYS_READ), (bytes_read = read(backpipe_fd[0], &buf[len], bufsize - len - 1)) > 0) {
+			len += bytes_read;
+			if (len + 1 >= bufsize) {
+				bufsize += RESULT_BUF_INC;
+				buf = realloc(buf, bufsize * sizeof(char));
+				if (!buf) {
+					fprintf(stderr, "tosh: memory allocation failed. :(\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		tosh_fd_close(backpipe_fd[0]);
+		DEBUG_LOG("parent: finished reading %d bytes from child.", len)
+
 		// Wait for child.
 		DEBUG_LOG("parent: waiting for child with pid %d...", id)
-		waitpid(id, NULL, 0);
+		TOSH_COUNT(TOSH_SYS_WAIT);
+		if (wait4(id, NULL, 0, &usage) == id)
+			tosh_report_child(&usage, NULL);
 
-		// Read from pipe (the data is buffered to a certain extent by kernel until we do so).
-		// ...but we wait above, because for longer output the buffer isn't always large enough.
-		bytes_read = read(backpipe_fd[0], buf, bufsize * sizeof(char));
-		close(backpipe_fd[0]);
-		DEBUG_LOG("parent: finished reading %d bytes from child.", bytes_read)
-
-		// Kill subshell.
-		kill(id, SIGTERM);
-
-		/* [NOTE: we really ought to implement dynamic buffer size adjustment here!!] */
-	
 		// Strip trailing newline.
-		if (buf[bytes_read - 1] == '\n')
-			buf[bytes_read - 1] = '\0';
-		else
-			buf[bytes_read - 1] = '\0';
+		if (len > 0 && buf[len - 1] == '\n')
+			len--;
+		buf[len] = '\0';
 
-		return buf;
+		result.str = buf;
+		result.len = len;
+		return result;
 	}
+}
+#endif
+
+/* The result of an expression we couldn't evaluate: an empty (dynamically allocated) string. */
+struct tosh_view tosh_eval_failed(void) {
+	struct tosh_view result = { malloc(sizeof(char)), 0 };
 
+	if (!result.str) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	*result.str = '\0';
+	return result;
 }
 
 /* Get and set environment variables to align with global (internal) shell variables.
  * Check for their presence first; use internal defaults if they don't exist. */
 void tosh_sync_env_vars(void) {
 	int i;
-	char *s;
+	char *s, *force = TOSH_FORCE_INTERACTIVE;
 	for (i = 0; i < tosh_num_glob(); i++) {
 		if ((s = getenv(glob_vars_str[i])) == NULL) {
 			// Couldn't find this environment variable -- we'll create it.
@@ -965,6 +1594,8 @@ void tosh_sync_env_vars(void) {
 		}
 
 	}
+	if (TOSH_FORCE_INTERACTIVE != force)
+		TOSH_INTERACTIVE = TOSH_STDIN_TTY || strcmp(TOSH_FORCE_INTERACTIVE, "ON") == 0;
 }
 
 void tosh_sigint(int sig) {
@@ -984,36 +1615,77 @@ void tosh_record_line(char *line) {
 		return;
 	}
 	if (fwrite(line, sizeof(char), linelen, TOSH_HIST_FILE) < linelen) {
-		fprintf(stderr, "tosh: I couldn't write everything to the history file. :(\n");
+		tosh_error("tosh: I couldn't write everything to the history file. :(\n");
 	} else {
 		fwrite("\n", sizeof(char), 1, TOSH_HIST_FILE);
 	}
-	fflush(TOSH_HIST_FILE);
+	// (It's written out along with our output, by tosh_flush().)
 }
 
 void tosh_open_hist(void) {
-	char *path, *expanded_path;
+	struct tosh_view path;
+
+	path = tosh_expand_tilde(tosh_view(TOSH_HIST_PATH));
+	TOSH_HIST_FILE = tosh_fd_fopen(path.str, "a+");
+	free(path.str);
+
+	if (TOSH_HIST_FILE == NULL) {
+		tosh_perror();
+		tosh_error("tosh: I couldn't open the history file. :(\n");
+	}
+}
 
-	path = malloc((strlen(TOSH_HIST_PATH) + 1) * sizeof(char));
-	if (!path) {
+/* Make a path absolute, by resolving the directory it's in (so that it still names the same file
+ * after a `cd`, even if the file itself doesn't exist yet). Returns a dynamically allocated string
+ * (requiring freeing later), or a null pointer (having said why) if the directory isn't there. */
+char *tosh_abs_path(char *path) {
+	char *slash = strrchr(path, '/'), *dir, *real, *abs;
+	struct tosh_view v = { path, (slash != NULL) ? slash - path : 0 };
+
+	// (The directory is whatever comes before the last slash: the root, if that's the first
+	// character; or the current directory, if there's no slash at all.)
+	dir = (slash == path) ? tosh_view_dup(tosh_view("/")) : tosh_view_dup((slash != NULL) ? v : tosh_view("."));
+	real = realpath(dir, NULL);
+	free(dir);
+	if (real == NULL) {
+		tosh_perror();
+		return NULL;
+	}
+	path = (slash != NULL) ? slash + 1 : path;
+	if ((abs = malloc((strlen(real) + strlen(path) + 2) * sizeof(char))) == NULL) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
-	strcpy(path, TOSH_HIST_PATH);
-	expanded_path = tosh_expand_tilde(path);
+	sprintf(abs, (strcmp(real, "/") == 0) ? "%s%s" : "%s/%s", real, path);
+	free(real);
+	return abs;
+}
 
-	TOSH_HIST_FILE = fopen(expanded_path, "a+");
-	free(expanded_path);
+/* Open the journal (if TOSH_JOURNAL names one, and we're running a script). */
+void tosh_open_journal(void) {
+	struct tosh_view path;
 
-	if (TOSH_HIST_FILE == NULL) {
-		perror("tosh");
-		fprintf(stderr, "tosh: I couldn't open the history file. :(\n");
-	}
+	if (TOSH_INTERACTIVE || strcmp(TOSH_JOURNAL, "OFF") == 0)
+		return;
+	path = tosh_expand_tilde(tosh_view(TOSH_JOURNAL));
+	tosh_journal_open(path.str);
+	free(path.str);
+}
+
+/* Start keeping track of where the time goes (if TOSH_REPORT says to, and we're running a script). */
+void tosh_open_report(void) {
+	struct tosh_view how;
+
+	if (TOSH_INTERACTIVE || strcmp(TOSH_REPORT, "OFF") == 0)
+		return;
+	how = tosh_expand_tilde(tosh_view(TOSH_REPORT));
+	tosh_report_open(how.str);
+	free(how.str);
 }
 
 void tosh_close_hist(void) {
-	if (fclose(TOSH_HIST_FILE) == EOF) {
-		fprintf(stderr, "tosh: I couldn't close the history file. :(\n");
+	if (tosh_fd_fclose(TOSH_HIST_FILE) == EOF) {
+		tosh_error("tosh: I couldn't close the history file. :(\n");
 	}
 }
 
@@ -1026,9 +1698,11 @@ void tosh_load_config(void) {
  * (Usually) called once at startup. */
 void tosh_init(void) {
 	char *cwd, *str;
+	int i;
 
 	// Store current directory (as previous directory for later).
 	cwd = malloc(TOSH_MAX_PATH * sizeof(char));
+	TOSH_COUNT(TOSH_SYS_GETCWD);
 	getcwd(cwd, TOSH_MAX_PATH * sizeof(char));
 	strcpy(TOSH_LAST_DIR, cwd);
 	free(cwd);
@@ -1038,6 +1712,16 @@ void tosh_init(void) {
 	sprintf(str, "%d", atoi(ENV_SHLVL) + 1);
 	setenv("SHLVL", str , 1);
 	free(str);
+
+	// Find out whether we're talking to a terminal (once, rather than every time we want to know).
+	tosh_tty_check();
+	TOSH_INTERACTIVE = TOSH_STDIN_TTY || strcmp(TOSH_FORCE_INTERACTIVE, "ON") == 0;
+
+	// Intern the names of builtins (so they can be recognised by pointer).
+	for (i = 0; i < tosh_num_builtins(); i++) {
+		if ((str = tosh_intern(builtin_str[i], strlen(builtin_str[i]))) != NULL)
+			builtin_str[i] = str;
+	}
 }
 
 /* ---- BUILTINS BELOW ---- */
@@ -1055,21 +1739,19 @@ int tosh_cd(char **args) {
 		fprintf(stderr, "tosh: memory allocation failed. :(\n");
 		exit(EXIT_FAILURE);
 	}
+	TOSH_COUNT(TOSH_SYS_GETCWD);
 	getcwd(cwd, TOSH_MAX_PATH * sizeof(char));
 
 	// No arguments to cd; go home.
 	if ((arg = args[1]) == NULL) {
 		char *homedir = getenv("HOME");
 		if (homedir != NULL) {
-			args[1] = malloc((strlen(homedir) + 1) * sizeof(char));
-			if (!args[1]) {
-				fprintf(stderr, "tosh: memory allocation failed. :(\n");
-				exit(EXIT_FAILURE);
-			}
-			strcpy(args[1], homedir);
-			return tosh_cd(args);
+			// (args is one block, with no room for another argument, so make a new list.)
+			char *homeargs[] = { args[0], homedir, NULL };
+			free(cwd);
+			return tosh_cd(homeargs);
 		} else {
-			fprintf(stderr, "tosh: I couldn't find your home directory. :(\n");
+			tosh_error("tosh: I couldn't find your home directory. :(\n");
 		}
 
 	// We have some arguments...
@@ -1085,8 +1767,9 @@ int tosh_cd(char **args) {
 			strcpy(TOSH_LAST_DIR, cwd);
 
 			// Go to (chronologically) previous directory.
+			TOSH_COUNT(TOSH_SYS_CHDIR);
 			if (chdir(lastdir) != 0) {
-				perror("tosh");
+				tosh_perror();
 			}
 			free(lastdir);
 
@@ -1096,13 +1779,14 @@ int tosh_cd(char **args) {
 				strcpy(TOSH_LAST_DIR, cwd);
 			}
 			// Change working directory of process to specified directory.
+			TOSH_COUNT(TOSH_SYS_CHDIR);
 			if (chdir(args[1]) != 0) {
-				perror("tosh");
+				tosh_perror();
 			}
 		}
 	} else {
 		// More than one argument to cd.
-		fprintf(stderr, "tosh: Where do you want to go?\n");
+		tosh_error("tosh: Where do you want to go?\n");
 	}
 
 	free(cwd);
@@ -1124,8 +1808,11 @@ int tosh_showenv(char **args) {
 /* Builtin wrapper for exec() syscall. */
 int tosh_exec(char **args) {
 	if (args[1] != NULL) {
+		tosh_flush();
+		tosh_journal_sync();
+		TOSH_COUNT(TOSH_SYS_EXEC);
 		if (execvp(args[1], args + 1) == -1) {
-			perror("tosh");
+			tosh_perror();
 		}
 	}
 	// (We should never end up here!)
@@ -1155,6 +1842,89 @@ int tosh_help(char **args) {
 	return 1;
 }
 
+/* Show the syscalls the shell has made (by phase), or forget them with `stats reset`. */
+int tosh_stats(char **args) {
+	if (args[1] != NULL && strcmp(args[1], "reset") == 0) {
+		tosh_stats_reset();
+	} else if (args[1] != NULL) {
+		tosh_error("tosh: usage: stats [reset]\n");
+	} else {
+		tosh_stats_show();
+	}
+
+	// Signal to continue.
+	return 1;
+}
+
+/* Run a program, splitting its arguments over as many invocations as it takes if there are
+ * too many to pass at once: `batch [-j JOBS] [-n MAX] [-w WORKERS] PROGRAM [OPTIONS...] ARGS...`.
+ * Leading arguments starting with `-` (up to `--`) are passed to every invocation, and up to
+ * JOBS invocations run at a time (one by default; `-j 0` means one per CPU). With `-n`, each
+ * gets no more than MAX of the rest; with `-w`, they're handed to WORKERS `tosh --worker`
+ * processes (`-w 0` meaning one per CPU) rather than run by the shell itself. */
+int tosh_batch(char **args) {
+	int jobs = 1, max_args = 0, workers = -1, num_fixed, failed, *opt;
+
+	for (args++; *args != NULL; args += 2) {
+		if (strcmp(*args, "-j") == 0)
+			opt = &jobs;
+		else if (strcmp(*args, "-n") == 0)
+			opt = &max_args;
+		else if (strcmp(*args, "-w") == 0)
+			opt = &workers;
+		else
+			break;
+		if (args[1] == NULL || (*opt = atoi(args[1])) < 0) {
+			tosh_error("tosh: usage: batch [-j JOBS] [-n MAX] [-w WORKERS] PROGRAM [ARGS...]\n");
+			return 1;
+		}
+	}
+	if (jobs == 0 && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		jobs = 1;
+	if (workers == 0 && (workers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		workers = 1;
+	if (*args == NULL) {
+		tosh_error("tosh: usage: batch [-j JOBS] [-n MAX] [-w WORKERS] PROGRAM [ARGS...]\n");
+		return 1;
+	}
+
+	// If it all fits in one go (and can go in one go), there's nothing special to do.
+	if (max_args == 0 && workers == -1 && tosh_args_fit(args))
+		return tosh_launch(args);
+
+	for (num_fixed = 1; args[num_fixed] != NULL && args[num_fixed][0] == '-'; num_fixed++) {
+		if (strcmp(args[num_fixed], "--") == 0) {
+			num_fixed++;
+			break;
+		}
+	}
+
+	// With nothing to split up, just run it the once (as xargs does).
+	if (args[num_fixed] == NULL)
+		return tosh_launch(args);
+
+	if (workers > 0)
+		failed = tosh_worker_launch(args, num_fixed, max_args, workers);
+	else
+		failed = tosh_batch_launch(args, num_fixed, max_args, jobs);
+	// (Invocations we waited for ourselves have said how they exited; others haven't.)
+	if (failed > 0 && tosh_report_status() == 0)
+		tosh_report_fail(1);
+
+	// Signal to continue.
+	return 1;
+}
+
+/* Start, talk to, or stop a helper program which is kept running between lines (see coproc.c):
+ * `coproc start NAME PROGRAM [ARGS...]`, then `coproc send|ask NAME WORDS...`,
+ * `coproc read NAME [LINES]` and `coproc stop NAME`; `coproc` alone lists them. */
+int tosh_coproc(char **args) {
+	tosh_coproc_run(args + 1);
+
+	// Signal to continue.
+	return 1;
+}
+
 int tosh_quit(char **args) {
 	if (strcmp(TOSH_VERBOSE, "ON") == 0) {
 		printf("Bye bye! :)\n");
@@ -1 +1,204 @@
+#ifndef TOSH_H
+#define TOSH_H
+
+#include <stdio.h> /* FILE */
+#include <stdatomic.h> /* atomic_long, etc. */
+
+// Colours
+#define RED    "\x1B[31m"
+#define GRN    "\x1B[32m"
+#define YEL    "\x1B[33m"
+#define BLU    "\x1B[34m"
+#define MAG    "\x1B[35m"
+#define CYN    "\x1B[36m"
+#define WHT    "\x1B[37m"
+#define BLD    "\033[1m"
+#define BLDRS  "\033[0m"
+#define RESET  "\x1B[0m"
+
+#define DEBUG_LOG(A, ...) if (strcmp(TOSH_DEBUG, "ON") == 0) {\
+			  	fprintf(stderr, BLD "log: " A BLDRS "\n", __VA_ARGS__);\
+			  }	
+
+#ifdef TOSH_FUZZ
+// (When built into the fuzz harness, allocations can be made to fail on purpose.)
+void *tosh_fuzz_malloc(size_t);
+void *tosh_fuzz_realloc(void *, size_t);
+#define malloc tosh_fuzz_malloc
+#define realloc tosh_fuzz_realloc
+#endif
+
+// Global shell options/variables (defined in tosh.c)
+extern char *TOSH_VERBOSE;
+extern char *TOSH_DEBUG;
+extern char *TOSH_READAHEAD;
+
+// Phases of the main loop (for counting syscalls).
+enum tosh_phase {
+	TOSH_PHASE_STARTUP,
+	TOSH_PHASE_PROMPT,
+	TOSH_PHASE_READ,
+	TOSH_PHASE_PARSE,
+	TOSH_PHASE_EXPAND,
+	TOSH_PHASE_EXECUTE,
+	TOSH_NUM_PHASES
+};
+
+// Kinds of syscall the shell makes (itself, rather than in the programs it runs).
+enum tosh_syscall {
+	TOSH_SYS_READ,
+	TOSH_SYS_WRITE,
+	TOSH_SYS_FORK,
+	TOSH_SYS_EXEC,
+	TOSH_SYS_WAIT,
+	TOSH_SYS_PIPE,
+	TOSH_SYS_TERMIOS,
+	TOSH_SYS_GETCWD,
+	TOSH_SYS_CHDIR,
+	TOSH_SYS_OPENDIR,
+	TOSH_SYS_STAT,
+	TOSH_SYS_GETDENTS,
+	TOSH_SYS_FSYNC,
+	TOSH_NUM_SYSCALLS
+};
+
+extern atomic_long TOSH_SYSCALLS[TOSH_NUM_PHASES][TOSH_NUM_SYSCALLS];
+extern _Thread_local int TOSH_PHASE;
+
+// Count a syscall (of the given kind) against the current phase. (Atomically, since the reader
+// thread counts too; but relaxed, since it's just a count, and nothing else depends on it.)
+#define TOSH_COUNT(S) atomic_fetch_add_explicit(&TOSH_SYSCALLS[TOSH_PHASE][S], 1, memory_order_relaxed)
+
+// Kinds of span: an expression to be evaluated in a subshell, a `~` to be replaced by HOME,
+// or a quoted or escaped character that would otherwise mean something in a pattern.
+#define TOSH_SPAN_SUBST   0
+#define TOSH_SPAN_TILDE   1
+#define TOSH_SPAN_LITERAL 2
+
+/* The location of something to be substituted within a word (as found by the lexer).
+ * The expression itself runs from si to ei, and the whole substring to be replaced
+ * (i.e. including the `$(` and `)`) from rsi to rei. (start indices included; end indices not.)
+ * Only unquoted and unescaped text gets spans (apart from literal ones); anything else in a word
+ * is taken literally. */
+struct tosh_span {
+	int si, ei;
+	int rsi, rei;
+	int kind;
+};
+
+// Words up to this long (including the null byte) are kept inside the word itself.
+#define TOSH_WORD_INLINE_LEN 16
+
+// Where a word's string lives: in its own buffer on the heap; inside the word (in buf);
+// or shared with other words (see intern.c), in which case it mustn't be freed.
+#define TOSH_WORD_HEAP     0
+#define TOSH_WORD_INLINE   1
+#define TOSH_WORD_INTERNED 2
+
+/* A string (or a slice of one) along with its length, so we needn't keep counting it.
+ * (str isn't necessarily null-terminated at len.) */
+struct tosh_view {
+	char *str;
+	int len;
+};
+
+/* A word of a command line (of length len), along with the expressions to be substituted in it.
+ * glob is set if it has an unquoted `*`, `?` or `[` (so is worth matching against filenames),
+ * and brace if it has an unquoted `{` (so may need brace expansion). */
+struct tosh_word {
+	char *str;
+	int len;
+	int storage;
+	struct tosh_span *spans;
+	int num_spans;
+	int glob;
+	int brace;
+	char buf[TOSH_WORD_INLINE_LEN];
+};
+
+// tosh.c
+struct tosh_view tosh_view(char *);
+struct tosh_view tosh_view_slice(struct tosh_view, int, int);
+char *tosh_view_dup(struct tosh_view);
+struct tosh_word *tosh_split_line(char *);
+void tosh_free_words(struct tosh_word *);
+void tosh_flush(void);
+void tosh_error(char *, ...);
+void tosh_perror(void);
+char *tosh_abs_path(char *);
+
+// fd.c
+int tosh_fd_own(int);
+int tosh_fd_pipe(int [2]);
+int tosh_fd_socketpair(int [2]);
+FILE *tosh_fd_fopen(char *, char *);
+int tosh_fd_close(int);
+int tosh_fd_fclose(FILE *);
+int tosh_fd_move(int, int);
+void tosh_fd_close_others(int *);
+
+// stats.c
+void tosh_stats_show(void);
+void tosh_stats_reset(void);
+
+// getchar_unbuf.c
+extern int TOSH_STDIN_TTY;
+void tosh_tty_check(void);
 int getchar_unbuf(void);
+
+// readahead.c
+int tosh_readahead_start(int);
+char *tosh_readahead_next(struct tosh_word **);
+void tosh_readahead_done(void);
+int tosh_readahead_ready(void);
+int tosh_readahead_finished(void);
+
+// intern.c
+char *tosh_intern(char *, int);
+
+// brace.c
+int tosh_brace_expand(struct tosh_view, long, void (*)(struct tosh_view, void *), void *);
+
+// batch.c
+long tosh_arg_max(void);
+long tosh_args_size(char **);
+int tosh_args_fit(char **);
+int tosh_batch_next(char **, int, long, int, long *);
+int tosh_batch_launch(char **, int, int, int);
+
+// worker.c
+extern char *TOSH_SELF;
+int tosh_worker_main(void);
+int tosh_worker_launch(char **, int, int, int);
+
+// coproc.c
+#define TOSH_MAX_COPROCS 16
+int tosh_coproc_run(char **);
+void tosh_coproc_keep(int *);
+
+// journal.c
+int tosh_journal_open(char *);
+int tosh_journal_active(void);
+int tosh_journal_done(long, char *);
+void tosh_journal_record(long, char *);
+void tosh_journal_sync(void);
+void tosh_journal_finish(void);
+
+// report.c
+struct rusage;
+int tosh_report_open(char *);
+int tosh_report_active(void);
+void tosh_report_start(void);
+void tosh_report_child(struct rusage *, int *);
+void tosh_report_fail(int);
+int tosh_report_status(void);
+void tosh_report_end(long, char *);
+void tosh_report_write(void);
+
+// walk.c
+char **tosh_walk_glob(char *, int, int);
+
+// sort.c
+void tosh_sort_strings(char **, long);
+
+#endif
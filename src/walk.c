@@ -0,0 +1,730 @@
+/* Globbing.
+ * Patterns are matched a component at a time, reading only the directories that the components
+ * before lead to (and looking up plain names without reading anything). A `**` component matches
+ * any number of directories (including none), so `src/` followed by `**` and then `*.c` is every
+ * .c file anywhere under src. Big trees take a while to walk, so once there's enough to do, several
+ * threads walk them at once: each directory is a job, and each thread works through its own stack
+ * of them (depth first), taking the oldest jobs of the others whenever it runs out.
+ * Directories are opened relative to their parent (never by full path, unless we've run short of
+ * file descriptors) and read with getdents64() where we have it, going by the file types it hands
+ * back rather than stat()ing everything (only asking, with statx(), about entries whose types the
+ * filesystem didn't give, and only if we need to know). With TOSH_GLOB_IGNORE on, anything the
+ * .gitignore files in the directories walked say to ignore is left out. The matches are packed into
+ * one block and sorted (see sort.c), so they come out in the same order whichever thread found them. */
+
+#define _GNU_SOURCE /* O_DIRECTORY, O_NOFOLLOW, DT_DIR etc. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <locale.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "tosh.h"
+
+// Most threads to walk with (and how many directories need to be waiting before we start them); size of buffer for reading directories; most directories to hold
+// open while they wait to be read (beyond that, they're opened by path when their turn comes).
+#define WALK_MAX_THREADS 8
+#define WALK_SPAWN_QUEUED 4
+#define WALK_DENTS_SIZE 32768
+#define WALK_MAX_OPEN 256
+
+// Buffer sizes for job stacks, matched paths and path building.
+#define WALK_JOBS_INC 64
+#define WALK_OUT_INC 4096
+#define WALK_PATH_INC 256
+
+#ifdef __linux__
+// A directory entry, as getdents64() hands them back.
+struct tosh_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+// A directory being read.
+struct tosh_dir {
+	int fd;
+#ifdef __linux__
+	char buf[WALK_DENTS_SIZE] __attribute__((aligned(8)));
+	int pos, len;
+#else
+	DIR *dir;
+#endif
+};
+
+// A rule from a .gitignore file.
+struct tosh_ignore_rule {
+	char *pat;
+	int negate, dir_only, anchored;
+};
+
+// The rules from one .gitignore file (and, through parent, those of the directories above it).
+struct tosh_ignore {
+	struct tosh_ignore *parent;
+	int dir_len; // (length of the path of its directory, as we print paths)
+	char *text;
+	struct tosh_ignore_rule *rules;
+	int num_rules;
+	int dir_rules; // (whether it, or any above it, has rules only for directories)
+	struct tosh_ignore *next; // (in the list of all of them, for freeing at the end)
+};
+
+// A directory to read, and which component of the pattern to match its entries against.
+struct tosh_walk_job {
+	char *path; // (as we print it, so "" for the current directory)
+	int fd;     // (or -1 to open it by path)
+	int comp;
+	struct tosh_ignore *ignore;
+	int star;   // (whether it's `**` going a level further down, rather than a match of the component before)
+};
+
+struct tosh_walk;
+
+// A thread walking the tree: its stack of jobs, the paths it has matched (one after another,
+// null-terminated), and the syscalls it has made.
+struct tosh_walk_worker {
+	struct tosh_walk *w;
+	pthread_t id;
+	pthread_mutex_t lock;
+	struct tosh_walk_job *jobs;
+	int head, num, max;
+	char *out;
+	long out_len, out_size;
+	int num_out;
+	char *path;
+	int path_size;
+	char *defer; // (entries whose types we need to find out: a byte for whether they matched, then the name)
+	long defer_len, defer_size;
+	long counts[TOSH_NUM_SYSCALLS];
+};
+
+// A whole walk: the pattern (split into components), and the jobs still to do.
+struct tosh_walk {
+	char **comps;
+	int num_comps, dirs_only, use_ignore;
+	struct tosh_walk_worker *workers;
+	int num_workers, started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending, queued, open_fds;
+	struct tosh_ignore *ignores;
+};
+
+// Where a worker is up to, in the pattern and the tree, reading a directory.
+struct tosh_walk_here {
+	struct tosh_walk_job *job;
+	int fd, star, n, last;
+	char *next;
+	struct tosh_ignore *ignore;
+};
+
+/* Make sure an allocation worked. */
+void *tosh_walk_check(void *p) {
+	if (!p) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Start reading the directory open as fd (which it takes over). Returns 0 on success, and -1 on failure. */
+int tosh_dir_open(struct tosh_dir *d, int fd) {
+	d->fd = fd;
+#ifdef __linux__
+	d->pos = d->len = 0;
+#else
+	if ((d->dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Get the name and type (a DT_ constant) of the next entry in a directory.
+ * Returns 1 if there was one, and 0 at the end (or on error). */
+int tosh_dir_next(struct tosh_dir *d, char **name, int *type, long *counts) {
+#ifdef __linux__
+	struct tosh_dirent64 *de;
+	long n;
+
+	if (d->pos >= d->len) {
+		counts[TOSH_SYS_GETDENTS]++;
+		if ((n = syscall(SYS_getdents64, d->fd, d->buf, WALK_DENTS_SIZE)) <= 0)
+			return 0;
+		d->pos = 0;
+		d->len = n;
+	}
+	de = (struct tosh_dirent64 *) &d->buf[d->pos];
+	d->pos += de->d_reclen;
+#else
+	struct dirent *de;
+
+	if ((de = readdir(d->dir)) == NULL)
+		return 0;
+#endif
+	*name = de->d_name;
+	*type = de->d_type;
+	return 1;
+}
+
+void tosh_dir_close(struct tosh_dir *d) {
+#ifdef __linux__
+	close(d->fd);
+#else
+	closedir(d->dir);
+#endif
+}
+
+/* Find out the type (a DT_ constant) of a directory entry that getdents64() didn't tell us,
+ * going through symlinks if follow is set. Returns DT_UNKNOWN if it isn't there.
+ * (With statx(), we ask for nothing but the type, so that filesystems which have to go and fetch
+ * the rest, like NFS, needn't bother.) */
+int tosh_walk_stat_type(int fd, char *name, int follow, long *counts) {
+	int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+#ifdef STATX_TYPE
+	struct statx st;
+
+	counts[TOSH_SYS_STAT]++;
+	if (statx(fd, name, flags | AT_STATX_DONT_SYNC, STATX_TYPE, &st) == -1)
+		return DT_UNKNOWN;
+	return IFTODT(st.stx_mode);
+#else
+	struct stat st;
+
+	counts[TOSH_SYS_STAT]++;
+	if (fstatat(fd, name, &st, flags) == -1)
+		return DT_UNKNOWN;
+	return IFTODT(st.st_mode);
+#endif
+}
+
+/* Check whether a directory entry (of the given type) is a directory, or a symlink to one. */
+int tosh_walk_is_dir(int fd, char *name, int type, long *counts) {
+	if (type == DT_DIR)
+		return 1;
+	if (type != DT_LNK && type != DT_UNKNOWN)
+		return 0;
+	return tosh_walk_stat_type(fd, name, 1, counts) == DT_DIR;
+}
+
+/* Read the .gitignore file (if any) in a directory (open as fd, printed as path), and add its
+ * rules to those above it. Returns the rules that apply to the directory's entries. */
+struct tosh_ignore *tosh_walk_ignore(struct tosh_walk_worker *wk, int fd, char *path, struct tosh_ignore *parent) {
+	struct tosh_walk *w = wk->w;
+	struct tosh_ignore *ig;
+	struct tosh_ignore_rule *r;
+	struct stat st;
+	char *line, *end, *text;
+	int gfd, n, len = 0;
+
+	if ((gfd = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC)) == -1)
+		return parent;
+	wk->counts[TOSH_SYS_STAT]++;
+	if (fstat(gfd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(gfd);
+		return parent;
+	}
+	text = tosh_walk_check(malloc((st.st_size + 1) * sizeof(char)));
+	while (len < st.st_size) {
+		wk->counts[TOSH_SYS_READ]++;
+		if ((n = read(gfd, &text[len], st.st_size - len)) <= 0)
+			break;
+		len += n;
+	}
+	close(gfd);
+	text[len] = '\0';
+
+	ig = tosh_walk_check(malloc(sizeof(struct tosh_ignore)));
+	ig->parent = parent;
+	ig->dir_len = strlen(path);
+	ig->text = text;
+	for (n = 1, line = text; *line; line++)
+		n += *line == '\n';
+	ig->rules = tosh_walk_check(malloc(n * sizeof(struct tosh_ignore_rule)));
+	ig->num_rules = 0;
+	ig->dir_rules = parent != NULL && parent->dir_rules;
+
+	// One pattern per line, ignoring blank lines and comments. `!` in front un-ignores things,
+	// a `/` on the end only matches directories, and a `/` anywhere else ties it to this directory
+	// (rather than matching names anywhere below).
+	for (line = text; line != NULL; line = end) {
+		if ((end = strchr(line, '\n')) != NULL)
+			*end++ = '\0';
+		for (n = strlen(line); n > 0 && (line[n - 1] == '\r' || line[n - 1] == ' '); n--)
+			line[n - 1] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		r = &ig->rules[ig->num_rules];
+		if ((r->negate = line[0] == '!'))
+			line++;
+		n = strlen(line);
+		if ((r->dir_only = n > 0 && line[n - 1] == '/'))
+			line[n - 1] = '\0';
+		r->anchored = strchr(line, '/') != NULL;
+		if (line[0] == '/')
+			line++;
+		if (line[0] == '\0')
+			continue;
+		r->pat = line;
+		ig->dir_rules |= r->dir_only;
+		ig->num_rules++;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	ig->next = w->ignores;
+	w->ignores = ig;
+	pthread_mutex_unlock(&w->lock);
+
+	return ig;
+}
+
+/* Check whether an entry (printed as path, and called name) is ignored by the rules in ig. */
+int tosh_walk_ignored(struct tosh_ignore *ig, char *path, char *name, int is_dir) {
+	struct tosh_ignore_rule *r;
+	char *rel;
+	int i;
+
+	// The nearest .gitignore with a rule for it wins (and within a file, the last rule).
+	for (; ig != NULL; ig = ig->parent) {
+		rel = path + ig->dir_len + (path[ig->dir_len] == '/');
+		for (i = ig->num_rules - 1; i >= 0; i--) {
+			r = &ig->rules[i];
+			if (r->dir_only && !is_dir)
+				continue;
+			if (fnmatch(r->pat, r->anchored ? rel : name, r->anchored ? FNM_PATHNAME : 0) == 0)
+				return !r->negate;
+		}
+	}
+	return 0;
+}
+
+/* Put the path of an entry (in the directory printed as dir) into the worker's path buffer. */
+char *tosh_walk_join(struct tosh_walk_worker *wk, char *dir, char *name) {
+	int dlen = strlen(dir), nlen = strlen(name), sep = dlen > 0 && dir[dlen - 1] != '/';
+
+	if (dlen + sep + nlen + 1 > wk->path_size) {
+		wk->path_size = dlen + sep + nlen + 1 + WALK_PATH_INC;
+		wk->path = tosh_walk_check(realloc(wk->path, wk->path_size * sizeof(char)));
+	}
+	memcpy(wk->path, dir, dlen);
+	wk->path[dlen] = '/';
+	memcpy(&wk->path[dlen + sep], name, nlen + 1);
+	return wk->path;
+}
+
+/* Note down a matched path (with a slash on the end, if we're only matching directories). */
+void tosh_walk_emit(struct tosh_walk_worker *wk, char *path) {
+	int plen = strlen(path), slash = wk->w->dirs_only && (plen == 0 || path[plen - 1] != '/');
+	long len = plen + 1 + slash;
+
+	if (wk->out_len + len > wk->out_size) {
+		wk->out_size = (wk->out_size + len) * 2 + WALK_OUT_INC;
+		wk->out = tosh_walk_check(realloc(wk->out, wk->out_size * sizeof(char)));
+	}
+	strcpy(&wk->out[wk->out_len], path);
+	if (slash)
+		strcat(&wk->out[wk->out_len], "/");
+	wk->out_len += len;
+	wk->num_out++;
+}
+
+/* Add a job to read the entry name (of the directory open as fd) to the worker's stack.
+ * star says whether it's `**` going a level further down (which doesn't go through symlinks). */
+void tosh_walk_push(struct tosh_walk_worker *wk, int fd, char *name, char *path, int comp,
+		int star, struct tosh_ignore *ig) {
+	struct tosh_walk *w = wk->w;
+	struct tosh_walk_job job;
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (star ? O_NOFOLLOW : 0), can_open;
+
+	pthread_mutex_lock(&w->lock);
+	if ((can_open = w->open_fds < WALK_MAX_OPEN))
+		w->open_fds++;
+	pthread_mutex_unlock(&w->lock);
+
+	// (If it isn't a directory after all, opening it fails, and there's nothing to do.)
+	job.fd = -1;
+	if (can_open) {
+		wk->counts[TOSH_SYS_OPENDIR]++;
+		if ((job.fd = openat(fd, name, flags)) == -1) {
+			pthread_mutex_lock(&w->lock);
+			w->open_fds--;
+			pthread_mutex_unlock(&w->lock);
+			if (errno != EMFILE && errno != ENFILE)
+				return;
+		}
+	}
+	job.path = tosh_walk_check(strdup(path));
+	job.comp = comp;
+	job.ignore = ig;
+	job.star = star;
+
+	pthread_mutex_lock(&wk->lock);
+	if (wk->num == wk->max) {
+		if (wk->head > 0) {
+			memmove(wk->jobs, &wk->jobs[wk->head], (wk->num - wk->head) * sizeof(struct tosh_walk_job));
+			wk->num -= wk->head;
+			wk->head = 0;
+		} else {
+			wk->max += WALK_JOBS_INC;
+			wk->jobs = tosh_walk_check(realloc(wk->jobs, wk->max * sizeof(struct tosh_walk_job)));
+		}
+	}
+	wk->jobs[wk->num++] = job;
+	pthread_mutex_unlock(&wk->lock);
+
+	pthread_mutex_lock(&w->lock);
+	w->pending++;
+	w->queued++;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Take a job: our own newest one if we have any (to carry on depth first), or else the oldest
+ * one of another worker (the most likely to have a big bit of tree under it).
+ * Returns 1 if there was a job to take. */
+int tosh_walk_take(struct tosh_walk_worker *wk, struct tosh_walk_job *job) {
+	struct tosh_walk *w = wk->w;
+	struct tosh_walk_worker *v;
+	int i, found = 0;
+
+	for (i = 0; i < w->num_workers && !found; i++) {
+		v = &w->workers[(wk - w->workers + i) % w->num_workers];
+		pthread_mutex_lock(&v->lock);
+		if (v->head < v->num) {
+			*job = (v == wk) ? v->jobs[--v->num] : v->jobs[v->head++];
+			if (v->head == v->num)
+				v->head = v->num = 0;
+			found = 1;
+		}
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	if (found) {
+		pthread_mutex_lock(&w->lock);
+		w->queued--;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return found;
+}
+
+/* Check whether a component of a pattern is just a name (with nothing in it to match). */
+int tosh_walk_is_literal(char *comp) {
+	return strpbrk(comp, "*?[\\") == NULL;
+}
+
+/* Deal with an entry of the directory being read, whose type we know (or don't need to). */
+void tosh_walk_entry(struct tosh_walk_worker *wk, struct tosh_walk_here *h, char *name, int type, int matched) {
+	struct tosh_walk *w = wk->w;
+	char *path = tosh_walk_join(wk, h->job->path, name);
+
+	if (h->ignore != NULL && tosh_walk_ignored(h->ignore, path, name, type == DT_DIR))
+		return;
+	if (matched && (h->next == NULL || h->n == h->last) && (!w->dirs_only || tosh_walk_is_dir(h->fd, name, type, wk->counts)))
+		tosh_walk_emit(wk, path);
+
+	// (Only directories, and symlinks to them, have anything under them.)
+	if (type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN) {
+		if (matched && h->next != NULL && h->n < h->last)
+			tosh_walk_push(wk, h->fd, name, path, h->n + 1, 0, h->ignore);
+		if (h->star && name[0] != '.' && type != DT_LNK)
+			tosh_walk_push(wk, h->fd, name, path, h->job->comp, 1, h->ignore);
+	}
+}
+
+/* Put off finding out the type of an entry until we've read the whole directory. */
+void tosh_walk_defer(struct tosh_walk_worker *wk, char *name, int matched) {
+	long len = strlen(name) + 2;
+
+	if (wk->defer_len + len > wk->defer_size) {
+		wk->defer_size = (wk->defer_size + len) * 2 + WALK_OUT_INC;
+		wk->defer = tosh_walk_check(realloc(wk->defer, wk->defer_size * sizeof(char)));
+	}
+	wk->defer[wk->defer_len] = matched;
+	strcpy(&wk->defer[wk->defer_len + 1], name);
+	wk->defer_len += len;
+}
+
+/* Read a directory, matching its entries against the job's component of the pattern: noting
+ * down matches of the last component, and adding jobs for directories which match the others. */
+void tosh_walk_dir(struct tosh_walk_worker *wk, struct tosh_walk_job *job) {
+	struct tosh_walk *w = wk->w;
+	struct tosh_walk_here h;
+	struct tosh_dir dir;
+	char *name, *path;
+	int fd = job->fd, type, matched;
+	long k;
+
+	if (fd == -1) {
+		wk->counts[TOSH_SYS_OPENDIR]++;
+		if ((fd = open((job->path[0] != '\0') ? job->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+			return;
+	}
+	h.job = job;
+	h.fd = fd;
+	h.last = w->num_comps - 1;
+	h.ignore = job->ignore;
+	if (w->use_ignore)
+		h.ignore = tosh_walk_ignore(wk, fd, job->path, h.ignore);
+
+	// `**` can match no directories at all, so at the end of a pattern it matches the directory
+	// it starts from, as well as everything under it.
+	if (!job->star && job->comp == h.last && strcmp(w->comps[job->comp], "**") == 0 && job->path[0] != '\0')
+		tosh_walk_emit(wk, tosh_walk_join(wk, job->path, ""));
+
+	// A plain name doesn't need the directory reading, just looking up (which also lets through
+	// `.` and `..`, which we never match otherwise).
+	if (tosh_walk_is_literal(w->comps[job->comp])) {
+		name = w->comps[job->comp];
+		path = tosh_walk_join(wk, job->path, name);
+		if (job->comp < h.last)
+			tosh_walk_push(wk, fd, name, path, job->comp + 1, 0, h.ignore);
+		else if (w->dirs_only ? tosh_walk_is_dir(fd, name, DT_UNKNOWN, wk->counts) : tosh_walk_stat_type(fd, name, 0, wk->counts) != DT_UNKNOWN)
+			tosh_walk_emit(wk, path);
+		close(fd);
+		return;
+	}
+	if (tosh_dir_open(&dir, fd) == -1)
+		return;
+
+	// `**` goes into every (non-hidden, non-symlinked) directory below, and since it can also
+	// match no directories at all, the entries are matched against whatever follows it too.
+	// (If nothing does, it matches everything.)
+	h.star = strcmp(w->comps[job->comp], "**") == 0;
+	h.n = job->comp + h.star;
+	h.next = (h.n <= h.last) ? w->comps[h.n] : NULL;
+
+	while (tosh_dir_next(&dir, &name, &type, wk->counts)) {
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (w->use_ignore && strcmp(name, ".git") == 0)
+			continue;
+		matched = (h.next != NULL) ? fnmatch(h.next, name, FNM_PERIOD) == 0 : name[0] != '.';
+		if (!matched && !(h.star && name[0] != '.'))
+			continue;
+
+		// Most filesystems tell us what each entry is. If this one didn't, and it matters (because
+		// we'd go into it if it's a directory, or it only counts if it's a directory), we'll have
+		// to ask; but not until we've read the whole directory, so as not to hold up reading it.
+		if (type == DT_UNKNOWN && (w->dirs_only || (h.ignore != NULL && h.ignore->dir_rules)
+				|| (h.star && name[0] != '.') || (matched && h.next != NULL && h.n < h.last))) {
+			tosh_walk_defer(wk, name, matched);
+			continue;
+		}
+		tosh_walk_entry(wk, &h, name, type, matched);
+	}
+
+	for (k = 0; k < wk->defer_len; k += strlen(&wk->defer[k + 1]) + 2) {
+		name = &wk->defer[k + 1];
+		tosh_walk_entry(wk, &h, name, tosh_walk_stat_type(fd, name, 0, wk->counts), wk->defer[k]);
+	}
+	wk->defer_len = 0;
+	tosh_dir_close(&dir);
+}
+
+void *tosh_walk_main(void *);
+
+/* Start the rest of the threads (from the first one, which is the calling thread). */
+void tosh_walk_spawn(struct tosh_walk *w) {
+	for (; w->started < w->num_workers; w->started++) {
+		if (pthread_create(&w->workers[w->started].id, NULL, tosh_walk_main, &w->workers[w->started]) != 0)
+			break;
+	}
+	DEBUG_LOG("walking with %d threads.", w->started)
+}
+
+/* Body of each walking thread (and of the calling thread, which walks too): do jobs until there
+ * are none left anywhere, and nobody is still doing one (which might make more). */
+void *tosh_walk_main(void *arg) {
+	struct tosh_walk_worker *wk = arg;
+	struct tosh_walk *w = wk->w;
+	struct tosh_walk_job job;
+	int done, spawn;
+
+	while (1) {
+		if (tosh_walk_take(wk, &job)) {
+			tosh_walk_dir(wk, &job);
+			free(job.path);
+			pthread_mutex_lock(&w->lock);
+			if (job.fd != -1)
+				w->open_fds--;
+			if (--w->pending == 0)
+				pthread_cond_broadcast(&w->cond);
+			// (Most patterns only read a directory or two, which isn't worth starting threads for.)
+			spawn = wk == w->workers && w->started == 1 && w->queued >= WALK_SPAWN_QUEUED;
+			pthread_mutex_unlock(&w->lock);
+			if (spawn)
+				tosh_walk_spawn(w);
+			continue;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		while (w->queued <= 0 && w->pending > 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		done = w->pending == 0;
+		pthread_mutex_unlock(&w->lock);
+		if (done)
+			return NULL;
+	}
+}
+
+/* Sort paths into the order of the locale's collation (by sorting keys from strxfrm(), which
+ * compare in byte order just as the paths do with strcoll(); each key has its path after it). */
+void tosh_walk_sort_locale(char **paths, long num) {
+	static int locale_set = 0;
+	char **keys, *key, *end;
+	long i, size = 0, len;
+
+	if (!locale_set) {
+		setlocale(LC_COLLATE, "");
+		locale_set = 1;
+	}
+	for (i = 0; i < num; i++)
+		size += strxfrm(NULL, paths[i], 0) + 1 + sizeof(char *);
+	keys = tosh_walk_check(malloc(num * sizeof(char *) + size * sizeof(char)));
+	key = (char *) &keys[num];
+	end = key + size;
+	for (i = 0; i < num; i++) {
+		keys[i] = key;
+		len = strxfrm(key, paths[i], end - key) + 1;
+		memcpy(&key[len], &paths[i], sizeof(char *));
+		key += len + sizeof(char *);
+	}
+	tosh_sort_strings(keys, num);
+	for (i = 0; i < num; i++)
+		memcpy(&paths[i], &keys[i][strlen(keys[i]) + 1], sizeof(char *));
+	free(keys);
+}
+
+/* Find the paths matching a pattern (which may have `**` components, besides the usual
+ * metacharacters), leaving out anything .gitignore files say to ignore if use_ignore is set.
+ * Returns a null-terminated list of them, sorted in byte order (or, if locale_order is set, as
+ * the locale would have them), all in one block for free(); or a null pointer if there weren't any. */
+char **tosh_walk_glob(char *pattern, int use_ignore, int locale_order) {
+	struct tosh_walk w;
+	struct tosh_walk_worker *wk;
+	struct tosh_ignore *ig;
+	char *buf, *base, *comp, **paths, *strs;
+	long total = 0, k;
+	int i, j, first, fd, num = 0;
+
+	// Split the pattern into its components, dropping empty ones and runs of `**`.
+	buf = tosh_walk_check(strdup(pattern));
+	w.comps = tosh_walk_check(malloc((strlen(pattern) / 2 + 2) * sizeof(char *)));
+	w.num_comps = 0;
+	w.dirs_only = buf[0] != '\0' && buf[strlen(buf) - 1] == '/';
+	for (comp = strtok(buf, "/"); comp != NULL; comp = strtok(NULL, "/")) {
+		if (strcmp(comp, "**") != 0 || w.num_comps == 0 || strcmp(w.comps[w.num_comps - 1], "**") != 0)
+			w.comps[w.num_comps++] = comp;
+	}
+
+	// Names at the start are where to start walking from.
+	for (first = 0; first < w.num_comps && tosh_walk_is_literal(w.comps[first]); first++)
+		;
+	base = tosh_walk_check(malloc((strlen(pattern) + 2) * sizeof(char)));
+	strcpy(base, (pattern[0] == '/') ? "/" : "");
+	for (i = 0; i < first; i++) {
+		strcat(base, w.comps[i]);
+		if (i + 1 < first)
+			strcat(base, "/");
+	}
+
+	w.use_ignore = use_ignore;
+	w.ignores = NULL;
+	w.pending = w.queued = w.open_fds = 0;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	if ((w.num_workers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		w.num_workers = 1;
+	if (w.num_workers > WALK_MAX_THREADS)
+		w.num_workers = WALK_MAX_THREADS;
+	w.workers = tosh_walk_check(calloc(w.num_workers, sizeof(struct tosh_walk_worker)));
+	for (i = 0; i < w.num_workers; i++) {
+		w.workers[i].w = &w;
+		pthread_mutex_init(&w.workers[i].lock, NULL);
+	}
+
+	// Start from the directory the names lead to (or just check the path exists, if that's all there is).
+	if (first == w.num_comps) {
+		TOSH_COUNT(TOSH_SYS_STAT);
+		if (access(base, F_OK) == 0)
+			tosh_walk_emit(&w.workers[0], base);
+	} else if (TOSH_COUNT(TOSH_SYS_OPENDIR), (fd = open((base[0] != '\0') ? base : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		wk = &w.workers[0];
+		wk->jobs = tosh_walk_check(malloc(WALK_JOBS_INC * sizeof(struct tosh_walk_job)));
+		wk->max = WALK_JOBS_INC;
+		wk->jobs[wk->num++] = (struct tosh_walk_job) { tosh_walk_check(strdup(base)), fd, first, NULL, 0 };
+		w.pending = w.queued = w.open_fds = 1;
+		w.started = 1;
+
+		tosh_walk_main(wk);
+		for (i = 1; i < w.started; i++)
+			pthread_join(w.workers[i].id, NULL);
+	}
+
+	// Gather up everyone's matches into one block, and sort them (and their syscalls into the counts).
+	for (i = 0; i < w.num_workers; i++) {
+		total += w.workers[i].out_len;
+		num += w.workers[i].num_out;
+		for (j = 0; j < TOSH_NUM_SYSCALLS; j++)
+			atomic_fetch_add_explicit(&TOSH_SYSCALLS[TOSH_PHASE][j], w.workers[i].counts[j], memory_order_relaxed);
+	}
+	paths = NULL;
+	if (num > 0) {
+		paths = tosh_walk_check(malloc((num + 1) * sizeof(char *) + total * sizeof(char)));
+		strs = (char *) &paths[num + 1];
+		for (i = j = 0; i < w.num_workers; i++) {
+			wk = &w.workers[i];
+			if (wk->out_len > 0)
+				memcpy(strs, wk->out, wk->out_len);
+			for (k = 0; k < wk->out_len; k += strlen(&strs[k]) + 1)
+				paths[j++] = &strs[k];
+			strs += wk->out_len;
+		}
+		if (locale_order)
+			tosh_walk_sort_locale(paths, num);
+		else
+			tosh_sort_strings(paths, num);
+
+		// (A pattern with more than one `**` in it can reach the same path more than one way.)
+		for (i = j = 1; i < num; i++) {
+			if (strcmp(paths[i], paths[j - 1]) != 0)
+				paths[j++] = paths[i];
+		}
+		paths[j] = NULL;
+	}
+
+	for (i = 0; i < w.num_workers; i++) {
+		free(w.workers[i].jobs);
+		free(w.workers[i].out);
+		free(w.workers[i].path);
+		free(w.workers[i].defer);
+		pthread_mutex_destroy(&w.workers[i].lock);
+	}
+	while ((ig = w.ignores) != NULL) {
+		w.ignores = ig->next;
+		free(ig->rules);
+		free(ig->text);
+		free(ig);
+	}
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
+	free(w.workers);
+	free(w.comps);
+	free(base);
+	free(buf);
+
+	return paths;
+}
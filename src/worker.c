@@ -0,0 +1,496 @@
+/* Workers.
+ * `batch -w WORKERS ...` hands its invocations to a pool of `tosh --worker` processes, rather
+ * than running them itself. Each worker talks to us over its stdin and stdout (a Unix socket)
+ * in length-prefixed messages: we send it commands to run, and it sends back their output as
+ * it comes, then how they exited. Nothing in this needs a worker to be on the same machine as
+ * us (only to have its stdin and stdout connected to us), though for now that's where we start
+ * them.
+ * Each worker is dealt a run of the invocations up front, and works through it from the front;
+ * one that runs out steals from the back of whichever worker has the most left. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h> /* wait4() */
+#include <spawn.h>
+#include "tosh.h"
+
+extern char **environ;
+
+// A message is a 4-byte length (of everything after it), a byte saying what kind of message it
+// is, the 4-byte number of the job it's about, then the rest. (Numbers are all big-endian.)
+#define WORKER_HEADER 9
+#define WORKER_RUN    'R' // (to a worker) the job's arguments, each null-terminated
+#define WORKER_OUTPUT 'O' // (from a worker) some of the job's output
+#define WORKER_DONE   'D' // (from a worker) the job's wait status, in 4 bytes
+
+// No message is this big (if one says it is, we've lost track of where messages start).
+#define WORKER_MAX_MESSAGE (1L << 30)
+
+// How much of a job's output a worker sends at a time, and how much room we make for reading.
+#define WORKER_CHUNK 65536
+#define WORKER_BUF_INC 65536
+
+// How many jobs a worker may have on the go (the next is sent before it finishes the last, so
+// it needn't wait for us), and how big a message can be to be sent before it's wanted. (Any
+// bigger and we could be stuck writing it while the worker is stuck writing its output to us.)
+#define WORKER_IN_FLIGHT 2
+#define WORKER_PIPELINE_MAX 16384
+
+#define WORKER_MAX 64
+
+// One end of a connection: where messages come in and go out, and what's been read of them.
+struct tosh_worker_conn {
+	int in_fd, out_fd;
+	char *buf;
+	long start, len, size;
+};
+
+// A worker, as the coordinator sees it: its connection and pid, its run of jobs (those from
+// next up to end are still to be sent), how many it's been sent that it hasn't finished, and
+// the unfinished last line of their output.
+struct tosh_worker {
+	struct tosh_worker_conn conn;
+	pid_t pid;
+	int alive;
+	long next, end;
+	int in_flight;
+	char *line;
+	long line_len, line_size;
+};
+
+/* Write/read a 4-byte big-endian number. */
+void tosh_worker_put32(char *p, unsigned long n) {
+	p[0] = (n >> 24) & 0xff;
+	p[1] = (n >> 16) & 0xff;
+	p[2] = (n >> 8) & 0xff;
+	p[3] = n & 0xff;
+}
+
+unsigned long tosh_worker_get32(char *p) {
+	unsigned char *u = (unsigned char *) p;
+
+	return ((unsigned long) u[0] << 24) | ((unsigned long) u[1] << 16) | ((unsigned long) u[2] << 8) | u[3];
+}
+
+/* Grow a buffer (of *size bytes) to hold at least need bytes. */
+char *tosh_worker_grow(char *buf, long *size, long need) {
+	if (need <= *size)
+		return buf;
+	*size = need + WORKER_BUF_INC;
+	if ((buf = realloc(buf, *size * sizeof(char))) == NULL) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+	return buf;
+}
+
+/* Send a message, whose len bytes of payload follow WORKER_HEADER bytes of room at msg.
+ * Returns 0 on success, and -1 on failure. */
+int tosh_worker_send(int fd, char *msg, int type, unsigned long id, long len) {
+	long i, n;
+
+	tosh_worker_put32(msg, len + WORKER_HEADER - 4);
+	msg[4] = type;
+	tosh_worker_put32(&msg[5], id);
+	for (i = 0; i < len + WORKER_HEADER; i += n) {
+		TOSH_COUNT(TOSH_SYS_WRITE);
+		if ((n = write(fd, &msg[i], len + WORKER_HEADER - i)) == -1) {
+			if (errno != EINTR)
+				return -1;
+			n = 0;
+		}
+	}
+	return 0;
+}
+
+/* Read whatever has arrived on a connection (waiting for something, if nothing has).
+ * Returns the number of bytes read: 0 at the end, and -1 on failure. */
+long tosh_worker_recv(struct tosh_worker_conn *c) {
+	long n;
+
+	if (c->start > 0) {
+		memmove(c->buf, &c->buf[c->start], c->len - c->start);
+		c->len -= c->start;
+		c->start = 0;
+	}
+	c->buf = tosh_worker_grow(c->buf, &c->size, c->len + WORKER_BUF_INC);
+	do {
+		TOSH_COUNT(TOSH_SYS_READ);
+	} while ((n = read(c->in_fd, &c->buf[c->len], c->size - c->len)) == -1 && errno == EINTR);
+	if (n > 0)
+		c->len += n;
+	return n;
+}
+
+/* Take the next message off a connection, if the whole of it has arrived, setting its type, id
+ * and payload (of len bytes, which is good until the next tosh_worker_recv()).
+ * Returns 1 if there was one, 0 if not (yet), and -1 if what's arrived isn't a message. */
+int tosh_worker_next(struct tosh_worker_conn *c, int *type, unsigned long *id, char **payload, long *len) {
+	unsigned long size;
+
+	if (c->len - c->start < WORKER_HEADER)
+		return 0;
+	size = tosh_worker_get32(&c->buf[c->start]);
+	if (size < WORKER_HEADER - 4 || size > WORKER_MAX_MESSAGE)
+		return -1;
+	if (c->len - c->start < (long) size + 4)
+		return 0;
+	*type = c->buf[c->start + 4];
+	*id = tosh_worker_get32(&c->buf[c->start + 5]);
+	*payload = &c->buf[c->start + WORKER_HEADER];
+	*len = size - (WORKER_HEADER - 4);
+	c->start += size + 4;
+	return 1;
+}
+
+/* ---- The worker's side ---- */
+
+/* Run a job for the coordinator, sending back its output (as it comes) and how it exited.
+ * (msg has room for WORKER_HEADER + WORKER_CHUNK bytes.) Returns 0 on success, and -1 if the
+ * coordinator can't be talked to any more. */
+int tosh_worker_run(int fd, unsigned long id, char **args, int null_fd, char *msg) {
+	posix_spawn_file_actions_t actions;
+	int out_fds[2], err, status = 127 << 8;
+	pid_t pid;
+	long n;
+
+	if (tosh_fd_pipe(out_fds) == -1) {
+		tosh_perror();
+	} else {
+		// It gets nothing on its stdin (ours is the coordinator), and its stdout goes to us.
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, null_fd, STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, out_fds[1], STDOUT_FILENO);
+		TOSH_COUNT(TOSH_SYS_FORK);
+		TOSH_COUNT(TOSH_SYS_EXEC);
+		err = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+		posix_spawn_file_actions_destroy(&actions);
+		tosh_fd_close(out_fds[1]);
+
+		if (err != 0) {
+			tosh_error("tosh: %s: %s\n", args[0], strerror(err));
+		} else {
+			// Pass its output on as it comes, then find out how it went.
+			while (TOSH_COUNT(TOSH_SYS_READ), (n = read(out_fds[0], &msg[WORKER_HEADER], WORKER_CHUNK)) != 0) {
+				if (n == -1 && errno == EINTR)
+					continue;
+				if (n == -1 || tosh_worker_send(fd, msg, WORKER_OUTPUT, id, n) == -1)
+					break;
+			}
+			do {
+				TOSH_COUNT(TOSH_SYS_WAIT);
+			} while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+		}
+		tosh_fd_close(out_fds[0]);
+	}
+
+	tosh_worker_put32(&msg[WORKER_HEADER], status);
+	return tosh_worker_send(fd, msg, WORKER_DONE, id, 4);
+}
+
+/* Be a worker (`tosh --worker`): run whatever jobs the coordinator sends on stdin, one after
+ * another, until it hangs up. Returns the exit status. */
+int tosh_worker_main(void) {
+	struct tosh_worker_conn c = { STDIN_FILENO, STDOUT_FILENO, NULL, 0, 0, 0 };
+	char **argv = NULL, *payload, *msg;
+	int type, argc, r, null_fd;
+	long len, i, max_argc = 0;
+	unsigned long id;
+
+	if ((null_fd = open("/dev/null", O_RDONLY)) == -1 || tosh_fd_own(null_fd) == -1) {
+		tosh_perror();
+		return EXIT_FAILURE;
+	}
+	if ((msg = malloc((WORKER_HEADER + WORKER_CHUNK) * sizeof(char))) == NULL) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		while ((r = tosh_worker_next(&c, &type, &id, &payload, &len)) == 0) {
+			if (tosh_worker_recv(&c) <= 0)
+				break;
+		}
+		if (r != 1) {
+			// (Either it's hung up, or we've lost track of what it's saying.)
+			if (r == -1)
+				tosh_error("tosh: the worker got something that wasn't a message. :(\n");
+			break;
+		}
+		if (type != WORKER_RUN)
+			continue;
+
+		// Point the arguments into the message (which stays put while the job runs).
+		for (argc = 0, i = 0; i < len; i++)
+			if (payload[i] == '\0')
+				argc++;
+		if (argc + 1 > max_argc) {
+			max_argc = argc + 1;
+			if ((argv = realloc(argv, max_argc * sizeof(char *))) == NULL) {
+				fprintf(stderr, "tosh: memory allocation failed. :(\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (argc = 0, i = 0; i < len && payload[len - 1] == '\0'; i += strlen(&payload[i]) + 1)
+			argv[argc++] = &payload[i];
+		argv[argc] = NULL;
+
+		if (argc == 0) {
+			tosh_worker_put32(&msg[WORKER_HEADER], 127 << 8);
+			r = tosh_worker_send(c.out_fd, msg, WORKER_DONE, id, 4);
+		} else {
+			r = tosh_worker_run(c.out_fd, id, argv, null_fd, msg);
+		}
+		if (r == -1)
+			break;
+	}
+
+	tosh_fd_close(null_fd);
+	free(c.buf);
+	free(argv);
+	free(msg);
+	return (r == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* ---- The coordinator's side ---- */
+
+/* Start a `tosh --worker` process, connected to us by a Unix socket.
+ * Returns 0 on success, and -1 (having said why) on failure. */
+int tosh_worker_start(struct tosh_worker *w) {
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { TOSH_SELF, "--worker", NULL };
+	int fds[2], err;
+
+	if (tosh_fd_socketpair(fds) == -1) {
+		tosh_perror();
+		return -1;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+	TOSH_COUNT(TOSH_SYS_FORK);
+	TOSH_COUNT(TOSH_SYS_EXEC);
+#ifdef __linux__
+	// (Whatever we were started as might not find us from here, e.g. after a `cd`.)
+	err = posix_spawn(&w->pid, "/proc/self/exe", &actions, NULL, argv, environ);
+#else
+	err = posix_spawnp(&w->pid, argv[0], &actions, NULL, argv, environ);
+#endif
+	posix_spawn_file_actions_destroy(&actions);
+	tosh_fd_close(fds[1]);
+	if (err != 0) {
+		tosh_error("tosh: I couldn't start a worker: %s\n", strerror(err));
+		tosh_fd_close(fds[0]);
+		return -1;
+	}
+
+	w->conn.in_fd = w->conn.out_fd = fds[0];
+	w->conn.buf = NULL;
+	w->conn.start = w->conn.len = w->conn.size = 0;
+	w->alive = 1;
+	w->in_flight = 0;
+	w->line = NULL;
+	w->line_len = w->line_size = 0;
+	return 0;
+}
+
+/* Choose the next job for worker w: the next of its own, or else the last of whichever worker
+ * has the most left (setting *from to which worker that is). Returns -1 if there are none left. */
+long tosh_worker_pick(struct tosh_worker *workers, int num, int w, int *from) {
+	int i;
+
+	*from = w;
+	if (workers[w].next < workers[w].end)
+		return workers[w].next;
+	for (i = 0; i < num; i++)
+		if (workers[i].end - workers[i].next > workers[*from].end - workers[*from].next)
+			*from = i;
+	return (*from == w) ? -1 : workers[*from].end - 1;
+}
+
+/* Write out the whole lines of a worker's output, and keep the rest (or, if done is set, write
+ * it all out). */
+void tosh_worker_output(struct tosh_worker *w, int done) {
+	long n;
+
+	for (n = w->line_len; !done && n > 0 && w->line[n - 1] != '\n'; n--)
+		;
+	if (n == 0)
+		return;
+	fwrite(w->line, sizeof(char), n, stdout);
+	memmove(w->line, &w->line[n], w->line_len - n);
+	w->line_len -= n;
+}
+
+/* Give up on a worker which has hung up on us (or can't be talked to). Returns the number of
+ * jobs it hadn't finished (which the rest of its run isn't counted in: others can steal that). */
+int tosh_worker_lost(struct tosh_worker *w) {
+	int lost = w->in_flight;
+
+	tosh_error("tosh: worker %d went away with %d job(s) unfinished. :(\n", w->pid, lost);
+	tosh_worker_output(w, 1);
+	tosh_fd_close(w->conn.in_fd);
+	w->alive = 0;
+	w->in_flight = 0;
+	return lost;
+}
+
+/* Run args[0] with its first num_fixed arguments and as many of the rest as will fit (or up to
+ * max_args of them), over and over until the rest are used up, as batch_launch() does, but
+ * spread over num_workers worker processes. Their output is written out a line at a time, as it
+ * comes in. Returns the number of invocations that failed. */
+int tosh_worker_launch(char **args, int num_fixed, int max_args, int num_workers) {
+	struct tosh_worker workers[WORKER_MAX];
+	struct pollfd fds[WORKER_MAX];
+	struct rusage usage;
+	long *bounds, *sizes, num_jobs, fixed_size, max, size, msg_size = 0, j, k, len, pos;
+	int num_args, i, w, from, type, r, failed = 0, in_flight, live;
+	unsigned long id;
+	char *msg = NULL, *payload;
+
+	for (num_args = 0; args[num_args] != NULL; num_args++)
+		;
+	bounds = malloc((num_args - num_fixed + 1) * sizeof(long));
+	sizes = malloc((num_args - num_fixed + 1) * sizeof(long));
+	if (!bounds || !sizes) {
+		fprintf(stderr, "tosh: memory allocation failed. :(\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Split up the arguments into jobs (job j gets those from bounds[j] up to bounds[j + 1]).
+	// (The fixed part goes in every one, leaving the rest whatever room there is, as in batch.c.)
+	max = tosh_arg_max() - tosh_args_size(environ) - sizeof(char *);
+	for (fixed_size = 0, i = 0; i < num_fixed; i++) {
+		fixed_size += strlen(args[i]) + 1;
+		max -= strlen(args[i]) + 1 + sizeof(char *);
+	}
+	for (num_jobs = 0, bounds[0] = num_fixed; bounds[num_jobs] < num_args; num_jobs++) {
+		bounds[num_jobs + 1] = tosh_batch_next(args, bounds[num_jobs], max, max_args, &size);
+		sizes[num_jobs] = size;
+	}
+
+	// Start the workers (no more than there are jobs for), and deal each a run of the jobs.
+	if (num_workers > WORKER_MAX)
+		num_workers = WORKER_MAX;
+	if (num_workers > num_jobs)
+		num_workers = num_jobs;
+	tosh_flush();
+	for (w = 0; w < num_workers && tosh_worker_start(&workers[w]) == 0; w++)
+		;
+	if ((num_workers = w) == 0) {
+		free(bounds);
+		free(sizes);
+		return num_jobs;
+	}
+	for (w = 0; w < num_workers; w++) {
+		workers[w].next = num_jobs * w / num_workers;
+		workers[w].end = num_jobs * (w + 1) / num_workers;
+	}
+	DEBUG_LOG("batch: %ld jobs over %d workers.", num_jobs, num_workers)
+
+	while (1) {
+		// Keep every worker busy (with one job waiting behind the one it's on, if it's small).
+		for (w = 0; w < num_workers; w++) {
+			while (workers[w].alive && workers[w].in_flight < WORKER_IN_FLIGHT
+					&& (j = tosh_worker_pick(workers, num_workers, w, &from)) != -1
+					&& (workers[w].in_flight == 0 || sizes[j] <= WORKER_PIPELINE_MAX)) {
+				if (from == w)
+					workers[w].next++;
+				else
+					workers[from].end--;
+
+				len = fixed_size + sizes[j];
+				if (WORKER_HEADER + len > msg_size)
+					msg = tosh_worker_grow(msg, &msg_size, WORKER_HEADER + len);
+				for (pos = WORKER_HEADER, i = 0; i < num_fixed + bounds[j + 1] - bounds[j]; i++) {
+					k = (i < num_fixed) ? i : bounds[j] + i - num_fixed;
+					len = strlen(args[k]) + 1;
+					memcpy(&msg[pos], args[k], len);
+					pos += len;
+				}
+				if (tosh_worker_send(workers[w].conn.out_fd, msg, WORKER_RUN, j, pos - WORKER_HEADER) == -1) {
+					failed += tosh_worker_lost(&workers[w]) + 1;
+					break;
+				}
+				workers[w].in_flight++;
+				if (strcmp(TOSH_VERBOSE, "ON") == 0)
+					printf("[sending %s (%ld arguments) to worker %d]\n", args[0],
+							num_fixed - 1 + bounds[j + 1] - bounds[j], workers[w].pid);
+			}
+		}
+
+		// Wait to hear from whichever workers have something on the go.
+		for (in_flight = live = w = 0; w < num_workers; w++) {
+			fds[w].fd = (workers[w].in_flight > 0) ? workers[w].conn.in_fd : -1;
+			fds[w].events = POLLIN;
+			in_flight += workers[w].in_flight;
+			live += workers[w].alive;
+		}
+		if (in_flight == 0) {
+			// Finished, unless there are jobs left that nobody is left to run.
+			if (live == 0)
+				for (w = 0; w < num_workers; w++)
+					failed += workers[w].end - workers[w].next;
+			break;
+		}
+		tosh_flush();
+		TOSH_COUNT(TOSH_SYS_WAIT);
+		if (poll(fds, num_workers, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			tosh_perror();
+			break;
+		}
+
+		for (w = 0; w < num_workers; w++) {
+			if (fds[w].fd == -1 || fds[w].revents == 0)
+				continue;
+			if (tosh_worker_recv(&workers[w].conn) <= 0) {
+				failed += tosh_worker_lost(&workers[w]);
+				continue;
+			}
+			while ((r = tosh_worker_next(&workers[w].conn, &type, &id, &payload, &len)) == 1) {
+				if (type == WORKER_OUTPUT) {
+					workers[w].line = tosh_worker_grow(workers[w].line, &workers[w].line_size, workers[w].line_len + len);
+					memcpy(&workers[w].line[workers[w].line_len], payload, len);
+					workers[w].line_len += len;
+					tosh_worker_output(&workers[w], 0);
+				} else if (type == WORKER_DONE && len == 4) {
+					tosh_worker_output(&workers[w], 1);
+					r = tosh_worker_get32(payload);
+					if (strcmp(TOSH_VERBOSE, "ON") == 0)
+						printf("[job %lu terminated on worker %d with exit code %d]\n", id, workers[w].pid, r / 256);
+					failed += !WIFEXITED(r) || WEXITSTATUS(r) != 0;
+					workers[w].in_flight--;
+				}
+			}
+			if (r == -1)
+				failed += tosh_worker_lost(&workers[w]);
+		}
+	}
+
+	// Hang up on them all (so they exit), and wait for them (counting the CPU they and their jobs
+	// used, for the report if there is one).
+	for (w = 0; w < num_workers; w++) {
+		if (workers[w].alive)
+			tosh_fd_close(workers[w].conn.in_fd);
+		do {
+			TOSH_COUNT(TOSH_SYS_WAIT);
+		} while ((r = wait4(workers[w].pid, NULL, 0, &usage)) == -1 && errno == EINTR);
+		if (r == workers[w].pid)
+			tosh_report_child(&usage, NULL);
+		free(workers[w].conn.buf);
+		free(workers[w].line);
+	}
+	free(msg);
+	free(bounds);
+	free(sizes);
+	return failed;
+}